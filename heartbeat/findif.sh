@@ -130,6 +130,23 @@ findif_check_params()
   return $OCF_SUCCESS
 }
 
+# IPv6 in one go: the findif binary checks the parameters and asks
+# the kernel over netlink, where the code below needs a dozen processes
+findif_inet6()
+{
+  local nicinfo rc
+
+  nicinfo=`$HA_BIN/findif -C 2>&1`
+  rc=$?
+  if [ $rc != 0 ] ; then
+    ocf_log err "$nicinfo"
+    return $rc
+  fi
+  set -- $nicinfo
+  echo "$1 netmask $3 broadcast $5"
+  return $OCF_SUCCESS
+}
+
 findif()
 {
   local match="$OCF_RESKEY_ip"
@@ -142,6 +159,10 @@ findif()
   echo $match | grep -qs ":"
   if [ $? = 0 ] ; then
     family="inet6"
+    if [ -x "$HA_BIN/findif" ] ; then
+      findif_inet6
+      return $?
+    fi
   else
     family="inet"
     scope="scope link"
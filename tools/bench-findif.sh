@@ -0,0 +1,156 @@
+#!/bin/sh
+
+# Benchmark for findif -b against a routing table the size of the
+# full Internet one, compared with one findif run per address.
+#
+# Everything happens in a private user+network namespace, so no root
+# and no real interfaces are needed.  The table is made up: ROUTES
+# prefixes, mostly /24 and /16 to /23 like the real one, spread over
+# DEVS veth devices.  The same random addresses are then looked up
+# by findif -b in one go, and a sample of them by findif one at a
+# time, whose answers must agree.
+
+export LC_ALL=C
+test -n "$BASH_VERSION" && set -o posix
+set -u
+
+die() { echo "$*"; exit 255; }
+warn() { echo "> $*"; }
+info() { echo "$*"; }
+
+HERE="$(cd "$(dirname "$0")" && pwd)"
+
+#
+# soft-config
+#
+
+: "${PRG:=${HERE}/findif}"
+: ${ROUTES:=900000}
+: ${LOOKUPS:=100000}
+: ${SINGLE:=200}
+: ${DEVS:=4}
+: ${SEED:=1}
+
+#
+# hard-wired
+#
+
+TMP=
+
+#
+# public routines
+#
+
+now_ms () { echo $(( $(date +%s%N) / 1000000 )); }
+
+setup () {
+	[ -x "${PRG}" ] || die "Forgot to compile ${PRG} for me to test?"
+
+	TMP="$(mktemp -d)" || die "Cannot create a temporary directory."
+
+	ip link set lo up
+	i=0
+	while [ $i -lt ${DEVS} ]; do
+		ip link add fb$i type veth peer name fbp$i \
+		    || die "Cannot create the veth pair fb$i."
+		ip link set fb$i up
+		ip link set fbp$i up
+		ip addr add 100.64.$i.1/24 dev fb$i
+		i=$((i+1))
+	done
+
+	# duplicates fail to be added, -force goes on regardless
+	awk -v n=${ROUTES} -v devs=${DEVS} -v seed=${SEED} 'BEGIN {
+		srand(seed)
+		for (i = 0; i < n; i++) {
+			r = rand()
+			if (r < 0.55) len = 24
+			else if (r < 0.75) len = 22 + int(rand() * 2)
+			else if (r < 0.95) len = 16 + int(rand() * 6)
+			else len = 8 + int(rand() * 8)
+			a = 1 + int(rand() * 223)
+			if (a == 100 || a == 127)
+				a++
+			ip = a * 16777216 + int(rand() * 16777216)
+			ip -= ip % 2 ^ (32 - len)
+			printf "route add %d.%d.%d.%d/%d dev fb%d\n",
+			    int(ip / 16777216), int(ip / 65536) % 256,
+			    int(ip / 256) % 256, ip % 256, len, int(rand() * devs)
+		}
+	}' > "${TMP}/routes"
+	start=$(now_ms)
+	ip -batch "${TMP}/routes" -force 2>/dev/null
+	info "table: $(ip -4 route | wc -l) routes, loaded in $(( $(now_ms) - start )) ms"
+
+	awk -v n=${LOOKUPS} -v seed=$((SEED+1)) 'BEGIN {
+		srand(seed)
+		for (i = 0; i < n; i++)
+			printf "%d.%d.%d.%d\n", 1 + int(rand() * 223),
+			    int(rand() * 256), int(rand() * 256), int(rand() * 256)
+	}' > "${TMP}/addrs"
+}
+
+teardown () {
+	[ -n "${TMP}" ] && rm -rf "${TMP}"
+	return 0
+}
+
+proceed () {
+	start=$(now_ms)
+	cat /proc/net/route > /dev/null
+	info "reading /proc/net/route once: $(( $(now_ms) - start )) ms"
+
+	start=$(now_ms)
+	echo 192.0.2.1 | "${PRG}" -b -C > /dev/null 2>&1
+	load=$(( $(now_ms) - start ))
+	info "findif -b, one address (route dump and trie): ${load} ms"
+
+	start=$(now_ms)
+	"${PRG}" -b -C < "${TMP}/addrs" > "${TMP}/batch" 2>/dev/null
+	batch=$(( $(now_ms) - start ))
+	info "findif -b, ${LOOKUPS} addresses: ${batch} ms," \
+	    "$(( (batch - load) * 1000 / LOOKUPS )) us per lookup"
+
+	start=$(now_ms)
+	head -n ${SINGLE} "${TMP}/addrs" | while read a; do
+		printf "%s\t" $a
+		OCF_RESKEY_ip=$a "${PRG}" -C 2>/dev/null || echo
+	done > "${TMP}/single"
+	single=$(( $(now_ms) - start ))
+	info "findif per address, ${SINGLE} addresses: ${single} ms," \
+	    "$(( single * 1000 / SINGLE )) us per address," \
+	    "$(( single * LOOKUPS / SINGLE )) ms for ${LOOKUPS}"
+
+	# no route: nothing from -b, an empty answer from findif
+	wrong=$(head -n ${SINGLE} "${TMP}/addrs" | awk -v b="${TMP}/batch" \
+	    -v s="${TMP}/single" -F '\t' '
+		BEGIN {
+			while ((getline l < b) > 0) { split(l, f); batch[f[1]] = l }
+			while ((getline l < s) > 0) { split(l, f); single[f[1]] = l }
+		}
+		{
+			x = ($1 in batch) ? batch[$1] : $1 "\t"
+			if (x != single[$1]) { n++; print "> " x " / " single[$1] > "/dev/stderr" }
+		}
+		END { print n + 0 }')
+	info "answers that differ: ${wrong} of ${SINGLE}"
+	[ "${wrong}" -eq 0 ]
+}
+
+if [ -z "${BENCH_FINDIF_NS:-}" ]; then
+	BENCH_FINDIF_NS=1 exec unshare -Urn "$0" "$@"
+fi
+
+case "${1:-}" in
+"")
+	;;
+*)
+	echo "usage: ./$0"
+	echo "settings via environment: PRG ROUTES LOOKUPS SINGLE DEVS SEED"
+	exit 0
+	;;
+esac
+
+trap teardown EXIT
+setup
+proceed
@@ -0,0 +1,111 @@
+#!/bin/sh
+
+# Benchmark for the tickle_tcp state file parser: the time to read a
+# text state file of LINES connections into the connection set.
+#
+# tickle_tcp -n 0 reads the connections and sends nothing, so no root
+# and no network are needed.  The file is made up: V6 percent of the
+# lines are IPv6, the rest IPv4, some of them duplicates.  Every run
+# must report the same number of unique connections; with OLD set to
+# another build of tickle_tcp (one that knows -S) both are timed on
+# the same file.
+
+export LC_ALL=C
+test -n "$BASH_VERSION" && set -o posix
+set -u
+
+die() { echo "$*"; exit 255; }
+warn() { echo "> $*"; }
+info() { echo "$*"; }
+
+HERE="$(cd "$(dirname "$0")" && pwd)"
+
+#
+# soft-config
+#
+
+: "${PRG:=${HERE}/tickle_tcp}"
+: ${OLD:=}
+: ${LINES:=1000000}
+: ${V6:=10}
+: ${RUNS:=3}
+: ${SEED:=1}
+
+#
+# hard-wired
+#
+
+TMP=
+
+#
+# public routines
+#
+
+now_ms () { echo $(( $(date +%s%N) / 1000000 )); }
+
+setup () {
+	[ -x "${PRG}" ] || die "Forgot to compile ${PRG} for me to test?"
+	[ -z "${OLD}" ] || [ -x "${OLD}" ] || die "${OLD} is not executable."
+
+	TMP="$(mktemp -d)" || die "Cannot create a temporary directory."
+
+	awk -v n=${LINES} -v v6=${V6} -v seed=${SEED} 'BEGIN {
+		srand(seed)
+		for (i = 0; i < n; i++) {
+			port = 1024 + int(rand() * 64000)
+			if (rand() * 100 < v6)
+				printf "2001:db8::10:80\t2001:db8:%x::%x:%d\n",
+				    int(rand() * 65536), int(rand() * 65536), port
+			else
+				printf "192.0.2.10:80\t10.%d.%d.%d:%d\n",
+				    int(rand() * 256), int(rand() * 256),
+				    int(rand() * 256), port
+		}
+	}' > "${TMP}/state"
+	info "state file: ${LINES} lines, $(wc -c < "${TMP}/state") bytes"
+}
+
+teardown () {
+	[ -n "${TMP}" ] && rm -rf "${TMP}"
+	return 0
+}
+
+# bench name prg: the best of RUNS, and the connections it found
+bench () {
+	best=
+	run=0
+	while [ ${run} -lt ${RUNS} ]; do
+		start=$(now_ms)
+		"$2" -n 0 -f "${TMP}/state" -S - > "${TMP}/$1" 2>&1 \
+		    || { cat "${TMP}/$1"; die "$2 failed."; }
+		ms=$(( $(now_ms) - start ))
+		[ -z "${best}" ] || [ ${ms} -lt ${best} ] && best=${ms}
+		run=$((run+1))
+	done
+	found=$(awk '/^tuples:/ {print $2}' "${TMP}/$1")
+	info "$1: ${best} ms, $(( LINES * 1000 / (best > 0 ? best : 1) )) lines/s," \
+	    "${found} connections"
+}
+
+proceed () {
+	bench new "${PRG}"
+	[ -z "${OLD}" ] && return 0
+	new_found=${found}
+	bench old "${OLD}"
+	[ "${found}" = "${new_found}" ] || warn "The connections found differ."
+	[ "${found}" = "${new_found}" ]
+}
+
+case "${1:-}" in
+"")
+	;;
+*)
+	echo "usage: ./$0"
+	echo "settings via environment: PRG OLD LINES V6 RUNS SEED"
+	exit 0
+	;;
+esac
+
+trap teardown EXIT
+setup
+proceed
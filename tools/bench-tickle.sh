@@ -0,0 +1,204 @@
+#!/bin/sh
+
+# Benchmark for tickle_tcp: packet rate and the time until the clients
+# of a failed over VIP notice that their connections are gone.
+#
+# Everything happens in a private user+network namespace, so no root
+# and no real interfaces are needed:
+#
+#   clients (this netns) veth0 --- veth1 VIP "old node" netns
+#                                       \.. moved to the "new node" netns
+#
+# N connections are opened to the VIP on the old node and saved with
+# tickle_tcp -d.  The failover moves veth1, VIP and all, to the new
+# node, which knows nothing about the connections.  tickle_tcp then
+# runs on the new node: each client answers a tickle ACK with its
+# real sequence numbers, the new node resets it, and the time until
+# the last client sees the reset is reported.
+
+export LC_ALL=C
+test -n "$BASH_VERSION" && set -o posix
+set -u
+
+die() { echo "$*"; exit 255; }
+warn() { echo "> $*"; }
+info() { echo "$*"; }
+
+HERE="$(cd "$(dirname "$0")" && pwd)"
+
+#
+# soft-config
+#
+
+: "${PRG:=${HERE}/tickle_tcp}"
+: ${CONNS:=1000}
+: ${ROUNDS:=3}
+: ${PPS:=0}
+: ${SPACING:=100}
+: ${TIMEOUT:=10}
+
+: ${CLIENT_IP:=198.51.100.2}
+: ${VIP:=198.51.100.1}
+: ${NM:=24}
+: ${PORT:=8080}
+
+#
+# hard-wired
+#
+
+TMP=
+OLD_PID=
+NEW_PID=
+CLIENT_PID=
+LISTENER_PID=
+
+# listen on the VIP; the connections need not even be accepted
+LISTENER='
+import socket, sys, time
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind((sys.argv[1], int(sys.argv[2])))
+s.listen(int(sys.argv[3]))
+print("listening", flush=True)
+time.sleep(3600)
+'
+
+# open the connections, then report when the last of them is reset;
+# give up after timeout seconds without any reset
+CLIENTS='
+import select, socket, sys, time
+vip, port, n, timeout = sys.argv[1], int(sys.argv[2]), int(sys.argv[3]), float(sys.argv[4])
+socks = {}
+for i in range(n):
+    s = socket.create_connection((vip, port))
+    socks[s.fileno()] = s
+print("ready", flush=True)
+p = select.poll()
+for fd in socks:
+    p.register(fd, select.POLLIN)
+last = 0.0
+while socks:
+    ev = p.poll(timeout * 1000)
+    if not ev:
+        break
+    for fd, _ in ev:
+        try:
+            socks[fd].recv(1)
+        except OSError:
+            pass
+        p.unregister(fd)
+        del socks[fd]
+        last = time.time()
+print("reset %d/%d last %.6f" % (n - len(socks), n, last), flush=True)
+'
+
+#
+# public routines
+#
+
+# in the old/new node
+old_node () { nsenter -t ${OLD_PID} -n "$@"; }
+new_node () { nsenter -t ${NEW_PID} -n "$@"; }
+
+wait_for () {
+	i=0
+	until grep -q "$2" "$1" 2>/dev/null; do
+		i=$((i+1))
+		[ $i -gt 600 ] && die "Timed out waiting for '$2' in $1."
+		sleep 0.1
+	done
+}
+
+setup () {
+	[ -x "${PRG}" ] || die "Forgot to compile ${PRG} for me to test?"
+	python3 -c "" 2>/dev/null || die "Need python3 for the clients."
+
+	TMP="$(mktemp -d)" || die "Cannot create a temporary directory."
+
+	ip link set lo up
+	unshare -n sleep 3600 &
+	OLD_PID=$!
+	unshare -n sleep 3600 &
+	NEW_PID=$!
+	sleep 0.2
+
+	ip link add veth0 type veth peer name veth1 \
+	    || die "Cannot create the veth pair."
+	ip link set veth1 netns ${OLD_PID} \
+	    || die "Cannot move veth1 to the old node."
+	ip addr add ${CLIENT_IP}/${NM} dev veth0
+	ip link set veth0 up
+	old_node ip addr add ${VIP}/${NM} dev veth1
+	old_node ip link set veth1 up
+	old_node ip link set lo up
+	new_node ip link set lo up
+	old_node sysctl -qw net.core.somaxconn=$((CONNS + 128)) 2>/dev/null \
+	    || warn "Cannot raise somaxconn, CONNS may be too large."
+
+	nsenter -t ${OLD_PID} -n python3 -c "${LISTENER}" \
+	    ${VIP} ${PORT} $((CONNS + 128)) > "${TMP}/listener" 2>&1 &
+	LISTENER_PID=$!
+	wait_for "${TMP}/listener" listening
+}
+
+teardown () {
+	[ -n "${CLIENT_PID}" ] && kill ${CLIENT_PID} 2>/dev/null
+	[ -n "${LISTENER_PID}" ] && kill ${LISTENER_PID} 2>/dev/null
+	[ -n "${OLD_PID}" ] && kill ${OLD_PID} 2>/dev/null
+	[ -n "${NEW_PID}" ] && kill ${NEW_PID} 2>/dev/null
+	[ -n "${TMP}" ] && rm -rf "${TMP}"
+	return 0
+}
+
+proceed () {
+	python3 -c "${CLIENTS}" ${VIP} ${PORT} ${CONNS} ${TIMEOUT} \
+	    > "${TMP}/clients" 2>&1 &
+	CLIENT_PID=$!
+	wait_for "${TMP}/clients" ready
+
+	old_node "${PRG}" -d ${VIP} -b -w "${TMP}/${VIP}" \
+	    || die "Cannot save the connections on the old node."
+
+	# failover: the VIP moves, its connections stay behind
+	old_node ip link set veth1 netns ${NEW_PID} \
+	    || die "Cannot move veth1 to the new node."
+	new_node ip addr add ${VIP}/${NM} dev veth1
+	new_node ip link set veth1 up
+	sleep 0.5
+
+	start=$(date +%s.%N)
+	new_node "${PRG}" -n ${ROUNDS} -p ${PPS} -s ${SPACING} \
+	    -S - -t "${TMP}" ${VIP} > "${TMP}/stats"
+	ec=$?
+	wait ${CLIENT_PID}
+	CLIENT_PID=
+
+	info "--- tickle_tcp (exit code ${ec}) ---"
+	cat "${TMP}/stats"
+	info "--- clients ---"
+	set -- $(grep "^reset" "${TMP}/clients" | tr '/' ' ')
+	[ $# -eq 5 ] || { cat "${TMP}/clients"; die "The clients failed."; }
+	info "connections reset: $2 of $3"
+	[ "$2" -gt 0 ] && echo "$5 ${start}" | awk \
+	    '{printf "recovery: %.1f ms after tickle_tcp started\n", ($1 - $2) * 1000}'
+	[ "$2" -eq "$3" ] && [ ${ec} -eq 0 ]
+}
+
+if [ -z "${BENCH_TICKLE_NS:-}" ]; then
+	BENCH_TICKLE_NS=1 exec unshare -Urn "$0" "$@"
+fi
+
+case "${1:-}" in
+"")
+	;;
+*)
+	echo "usage: ./$0"
+	echo "settings via environment: PRG CONNS ROUNDS PPS SPACING TIMEOUT"
+	echo "                          CLIENT_IP VIP NM PORT"
+	exit 0
+	;;
+esac
+
+trap teardown EXIT
+setup
+proceed
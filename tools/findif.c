@@ -4,7 +4,8 @@
  *	It's really simple to write in C, but hard to write in the shell...
  *
  *	This code is dependent on IPV4 addressing conventions...
- *		Sorry.
+ *		Sorry.  IPv6 addresses are looked up over netlink only,
+ *		so on Linux only.
  *
  * Copyright (C) 2000 Alan Robertson <alanr@unix.sh>
  * Copyright (C) 2001 Matt Soffen <matt@soffen.com>
@@ -78,6 +79,10 @@
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#endif
 #include <agent_config.h>
 #include <config.h>
 
@@ -128,10 +133,16 @@ typedef int SearchRoute (char *address, struct in_addr *in
 ,        unsigned long *best_netmask, char *errmsg
 ,	int errmsglen);
 
+#ifdef __linux__
+static SearchRoute SearchUsingNetlink;
+#endif
 static SearchRoute SearchUsingProcRoute;
 static SearchRoute SearchUsingRouteCmd;
 
 static SearchRoute *search_mechs[] = {
+#ifdef __linux__
+	&SearchUsingNetlink,
+#endif
 	&SearchUsingProcRoute,
 	&SearchUsingRouteCmd,
 	NULL
@@ -170,6 +181,629 @@ void usage(int ec);
 #define	BAD_BROADCAST	(0L)
 #define	MAXSTR	128
 
+#ifdef __linux__
+/*
+ * Ask the kernel itself: an RTM_GETROUTE get for the address goes
+ * through the policy rules and every table, just as a packet to it
+ * would.  The netmask is that of the address of the outgoing
+ * interface which covers ours, else that of the matching route.
+ * An address that is already ours routes via the local table, so
+ * then its own interface and prefix are taken.  The same goes for
+ * IPv4 and IPv6.
+ */
+static int
+NetlinkTalk (int fd, struct nlmsghdr *req
+,	int (*fn)(struct nlmsghdr *nh, void *arg), void *arg)
+{
+	char	buf[16384];
+	struct nlmsghdr *nh;
+	int	len;
+
+	if (send(fd, req, req->nlmsg_len, 0) < 0) {
+		return -errno;
+	}
+	for (;;) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -errno;
+		}
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len)
+		;	nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_seq != req->nlmsg_seq) {
+				continue;
+			}
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				return 0;
+			}
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				return ((struct nlmsgerr *)NLMSG_DATA(nh))->error;
+			}
+			fn(nh, arg);
+			if (!(nh->nlmsg_flags & NLM_F_MULTI)) {
+				return 0;
+			}
+		}
+	}
+}
+
+struct nl_route {
+	int	family;
+	unsigned char	dst[16];	/* network order, 4 bytes of it for AF_INET */
+	int	found;
+	int	type;
+	int	dst_len;
+	int	oif;
+	int	prefixlen;	/* -1 until an address covers dst */
+	int	exact;		/* local: dst itself is that address */
+};
+
+#define NL_ADDRLEN(family)	((family) == AF_INET6 ? 16 : 4)
+
+/* Do the first len bits of a and b agree? */
+static int
+NetlinkCovers (const unsigned char *a, const unsigned char *b, int len)
+{
+	int	n = len / 8;
+
+	if (memcmp(a, b, n) != 0) {
+		return 0;
+	}
+	return len % 8 == 0
+	||	((a[n] ^ b[n]) & (0xff00 >> (len % 8))) == 0;
+}
+
+static int
+NetlinkRoute (struct nlmsghdr *nh, void *arg)
+{
+	struct nl_route	*r = arg;
+	struct rtmsg	*rtm = NLMSG_DATA(nh);
+	struct rtattr	*rta;
+	int	attrlen = RTM_PAYLOAD(nh);
+
+	if (nh->nlmsg_type != RTM_NEWROUTE || rtm->rtm_family != r->family) {
+		return 0;
+	}
+	r->found = 1;
+	r->type = rtm->rtm_type;
+	r->dst_len = rtm->rtm_dst_len;
+	for (rta = RTM_RTA(rtm); RTA_OK(rta, attrlen)
+	;	rta = RTA_NEXT(rta, attrlen)) {
+		switch (rta->rta_type) {
+		case RTA_OIF:
+			r->oif = *(int *)RTA_DATA(rta);
+			break;
+		case RTA_MULTIPATH:
+			/* the first hop, as FibRouteMsg takes it for -b */
+			if (!r->oif && RTA_PAYLOAD(rta) >= sizeof(struct rtnexthop)) {
+				r->oif = ((struct rtnexthop *)RTA_DATA(rta))->rtnh_ifindex;
+			}
+			break;
+		}
+	}
+	return 0;
+}
+
+static int
+NetlinkAddr (struct nlmsghdr *nh, void *arg)
+{
+	struct nl_route	*r = arg;
+	struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+	struct rtattr	*rta;
+	int	attrlen = IFA_PAYLOAD(nh);
+	int	alen = NL_ADDRLEN(r->family);
+	unsigned char	local[16], *addr = NULL;
+
+	if (nh->nlmsg_type != RTM_NEWADDR || ifa->ifa_family != r->family) {
+		return 0;
+	}
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, attrlen)
+	;	rta = RTA_NEXT(rta, attrlen)) {
+		/* IFA_LOCAL is ours, IFA_ADDRESS the peer's on p-t-p links */
+		if ((rta->rta_type == IFA_LOCAL
+		||	(rta->rta_type == IFA_ADDRESS && addr == NULL))
+		&&	(int)RTA_PAYLOAD(rta) >= alen) {
+			memcpy(local, RTA_DATA(rta), alen);
+			addr = local;
+		}
+	}
+	if (addr == NULL) {
+		return 0;
+	}
+
+	/*
+	 * A local route has lo as its interface: the address itself
+	 * tells the interface, else one covering it (127.0.0.0/8)
+	 */
+	if (r->type == RTN_LOCAL) {
+		if (memcmp(addr, r->dst, alen) == 0 && !r->exact) {
+			r->exact = 1;
+			r->oif = ifa->ifa_index;
+			r->prefixlen = ifa->ifa_prefixlen;
+			return 0;
+		}
+		if (r->exact) {
+			return 0;
+		}
+	} else if ((int)ifa->ifa_index != r->oif) {
+		return 0;
+	}
+	if (NetlinkCovers(addr, r->dst, ifa->ifa_prefixlen)
+	&&	(int)ifa->ifa_prefixlen > r->prefixlen) {
+		r->oif = ifa->ifa_index;
+		r->prefixlen = ifa->ifa_prefixlen;
+	}
+	return 0;
+}
+
+/*
+ * The route to r->dst, via oif only if that is not 0.  On success
+ * r->oif and r->prefixlen are the answer.
+ * Return code as for SearchRoute, without the message.
+ */
+static int
+NetlinkLookup (struct nl_route *r, int oif)
+{
+	struct {
+		struct nlmsghdr	nh;
+		union {
+			struct rtmsg	rtm;
+			struct ifaddrmsg ifa;
+		} u;
+		char	attrs[RTA_SPACE(16) + RTA_SPACE(sizeof(int))];
+	} req;
+	struct rtattr	*rta;
+	int	alen = NL_ADDRLEN(r->family);
+	int	fd, err;
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd < 0) {
+		return -1;
+	}
+	r->found = 0;
+	r->oif = 0;
+	r->prefixlen = -1;
+	r->exact = 0;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg))
+	+	RTA_SPACE(alen);
+	req.nh.nlmsg_type = RTM_GETROUTE;
+	req.nh.nlmsg_flags = NLM_F_REQUEST;
+	req.nh.nlmsg_seq = 1;
+	req.u.rtm.rtm_family = r->family;
+	req.u.rtm.rtm_dst_len = alen * 8;
+#ifdef RTM_F_FIB_MATCH
+	/*
+	 * The route as configured, not the host route it resolves to.
+	 * Kernels before 4.13 ignore the flag rather than refuse it.
+	 */
+	req.u.rtm.rtm_flags = RTM_F_FIB_MATCH;
+#endif
+	rta = RTM_RTA(&req.u.rtm);
+	rta->rta_type = RTA_DST;
+	rta->rta_len = RTA_LENGTH(alen);
+	memcpy(RTA_DATA(rta), r->dst, alen);
+	if (oif) {
+		rta = (struct rtattr *)((char *)&req + req.nh.nlmsg_len);
+		rta->rta_type = RTA_OIF;
+		rta->rta_len = RTA_LENGTH(sizeof(int));
+		memcpy(RTA_DATA(rta), &oif, sizeof(int));
+		req.nh.nlmsg_len += RTA_SPACE(sizeof(int));
+	}
+
+	err = NetlinkTalk(fd, &req.nh, NetlinkRoute, r);
+	/* IPv6 answers with a reject route where IPv4 fails */
+	if (err == -ENETUNREACH || err == -EHOSTUNREACH
+	||	(err == 0 && (!r->found || r->type == RTN_UNREACHABLE
+		|| r->type == RTN_BLACKHOLE || r->type == RTN_PROHIBIT
+		|| r->type == RTN_THROW))) {
+		close(fd);
+		return(OCF_ERR_GENERIC);
+	}
+	if (err < 0) {
+		close(fd);
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+	req.nh.nlmsg_type = RTM_GETADDR;
+	req.nh.nlmsg_flags = NLM_F_REQUEST|NLM_F_DUMP;
+	req.nh.nlmsg_seq = 2;
+	req.u.ifa.ifa_family = r->family;
+	err = NetlinkTalk(fd, &req.nh, NetlinkAddr, r);
+	close(fd);
+	if (err < 0) {
+		return -1;
+	}
+
+	/*
+	 * A host route may be one in the table, or, from a kernel that
+	 * ignored RTM_F_FIB_MATCH, the one the lookup resolved to: with
+	 * no address to tell the prefix, leave it to the next mechanism.
+	 */
+	if (r->prefixlen < 0 && r->type != RTN_LOCAL && r->dst_len == alen * 8) {
+		return -1;
+	}
+	if (r->prefixlen < 0) {
+		r->prefixlen = r->type == RTN_LOCAL ? alen * 8 : r->dst_len;
+	}
+	return(OCF_SUCCESS);
+}
+
+static int
+SearchUsingNetlink (char *address, struct in_addr *in
+,	struct in_addr *addr_out, char *best_if, size_t best_iflen
+,	unsigned long *best_netmask
+,	char *errmsg, int errmsglen)
+{
+	struct nl_route	r;
+	char	ifname[IF_NAMESIZE];
+	int	rc;
+
+	memset(&r, 0, sizeof(r));
+	r.family = AF_INET;
+	memcpy(r.dst, in, sizeof(*in));
+	rc = NetlinkLookup(&r, 0);
+	if (rc > 0) {
+		snprintf(errmsg, errmsglen, "No route to %s\n", address);
+		return(OCF_ERR_GENERIC);
+	}
+	if (rc < 0) {
+		return -1;
+	}
+	if (r.oif == 0 || if_indextoname(r.oif, ifname) == NULL) {
+		snprintf(errmsg, errmsglen, "No interface found.");
+		return(OCF_ERR_GENERIC);
+	}
+	strncpy(best_if, ifname, best_iflen);
+	*best_netmask = r.prefixlen
+	?	htonl(0xffffffffUL << (32 - r.prefixlen)) : 0;
+	*addr_out = *in;
+	return(OCF_SUCCESS);
+}
+
+/*
+ * IPv6 addresses go to netlink only, with the checks and answers of
+ * findif() in findif.sh: the interface and the prefix length of the
+ * route, which with no nic given must be the netmask if that is
+ * given too.  The netmask is always in bits, the broadcast address
+ * is echoed as given.
+ */
+static int
+FindInet6 (char *address, char *netmaskbits, char *if_specified
+,	char *bcast_arg, int batch)
+{
+	struct nl_route	r;
+	char	ifname[IF_NAMESIZE];
+	int	oif = 0, nmbits = 0, rc;
+	size_t	len;
+
+	memset(&r, 0, sizeof(r));
+	r.family = AF_INET6;
+	if (inet_pton(AF_INET6, address, r.dst) <= 0) {
+		fprintf(stderr, "IP address [%s] not valid.\n", address);
+		return(OCF_ERR_CONFIGURED);
+	}
+	if (netmaskbits != NULL && *netmaskbits != EOS) {
+		len = strnlen(netmaskbits, 4);
+		if (len > 3 || strspn(netmaskbits, "0123456789") != len
+		||	(nmbits = atoi(netmaskbits)) < 1 || nmbits > 128) {
+			fprintf(stderr, "Invalid netmask specification [%s].\n"
+			,	netmaskbits);
+			return(OCF_ERR_CONFIGURED);
+		}
+	}
+	if (if_specified != NULL && *if_specified != EOS) {
+		oif = if_nametoindex(if_specified);
+		if (oif == 0) {
+			fprintf(stderr, "Unknown interface [%s] No such device.\n"
+			,	if_specified);
+			return(OCF_ERR_CONFIGURED);
+		}
+	}else if (IN6_IS_ADDR_LINKLOCAL((struct in6_addr *)r.dst)) {
+		fprintf(stderr, "'nic' parameter is mandatory for a link local"
+		" address [%s].\n", address);
+		return(OCF_ERR_CONFIGURED);
+	}
+
+	/*
+	 * As in findif.sh, the default route tells no prefix; nor does a
+	 * host route that may be just the resolved default (rc < 0)
+	 */
+	rc = NetlinkLookup(&r, oif);
+	if (rc == 0 && (r.prefixlen == 0 || (oif && r.oif != oif))) {
+		rc = OCF_ERR_GENERIC;
+	}
+	if (rc != 0) {
+		if (oif == 0 || nmbits == 0) {
+			fprintf(stderr, "Unable to find nic or netmask for %s.\n"
+			,	address);
+			return(OCF_ERR_GENERIC);
+		}
+		/* both given, nothing to find */
+		r.oif = oif;
+		r.prefixlen = nmbits;
+	}else if (nmbits) {
+		if (oif == 0 && nmbits != r.prefixlen) {
+			fprintf(stderr, "Unable to find nic, or netmask mismatch"
+			" for %s.\n", address);
+			return(OCF_ERR_GENERIC);
+		}
+		r.prefixlen = nmbits;
+	}
+	if (if_indextoname(r.oif, ifname) == NULL) {
+		fprintf(stderr, "No interface found.\n");
+		return(OCF_ERR_GENERIC);
+	}
+
+	if (batch) {
+		printf("%s\t", address);
+	}
+	printf("%s\tnetmask %d\tbroadcast %s\n", ifname, r.prefixlen
+	,	bcast_arg != NULL ? bcast_arg : "");
+	return(OCF_SUCCESS);
+}
+
+/*
+ * Batch mode (-b) builds its own copy of the main routing table from
+ * one RTM_GETROUTE dump, so that no lookup has to go to the kernel or
+ * through the whole table: a path-compressed binary trie, where each
+ * lookup visits at most one node per bit of the prefix.  Unlike the
+ * single lookup it knows nothing of policy rules, just like
+ * /proc/net/route; of two routes to the same prefix the one with the
+ * lower metric wins.
+ */
+struct fib_route {
+	int	oif;		/* 0 for unreachable and the like */
+	uint32_t	metric;
+};
+
+struct fib_node {
+	uint32_t	key;	/* host order, the bits past len are 0 */
+	int	len;
+	int	route;		/* index in routes, or -1 */
+	int	child[2];
+};
+
+struct fib {
+	struct fib_node	*nodes;
+	int	nnodes, anodes;
+	int	root;
+	struct fib_route *routes;
+	int	nroutes, aroutes;
+	int	failed;
+};
+
+#define FIB_BIT(key, i)		(((key) >> (31 - (i))) & 1)
+#define FIB_MASK(len)		((len) ? 0xffffffffU << (32 - (len)) : 0)
+
+static int
+FibNode (struct fib *t, uint32_t key, int len, int route)
+{
+	struct fib_node	*n;
+
+	if (t->nnodes == t->anodes) {
+		int	a = t->anodes ? 2 * t->anodes : 1024;
+
+		n = realloc(t->nodes, a * sizeof(*n));
+		if (n == NULL) {
+			return -1;
+		}
+		t->nodes = n;
+		t->anodes = a;
+	}
+	n = &t->nodes[t->nnodes];
+	n->key = key & FIB_MASK(len);
+	n->len = len;
+	n->route = route;
+	n->child[0] = n->child[1] = -1;
+	return t->nnodes++;
+}
+
+/* Where *slot was, hang the new node; slots move with realloc() */
+#define FIB_SLOT(t, parent, side) \
+	((parent) < 0 ? &(t)->root : &(t)->nodes[parent].child[side])
+
+static int
+FibInsert (struct fib *t, uint32_t key, int len, int oif, uint32_t metric)
+{
+	int	parent = -1, side = 0, idx, mid, leaf, common, route;
+	uint32_t	diff;
+	struct fib_node	*n;
+
+	if (t->nroutes == t->aroutes) {
+		int	a = t->aroutes ? 2 * t->aroutes : 1024;
+		struct fib_route *r = realloc(t->routes, a * sizeof(*r));
+
+		if (r == NULL) {
+			return -1;
+		}
+		t->routes = r;
+		t->aroutes = a;
+	}
+	route = t->nroutes;
+	t->routes[route].oif = oif;
+	t->routes[route].metric = metric;
+	key &= FIB_MASK(len);
+
+	for (;;) {
+		idx = *FIB_SLOT(t, parent, side);
+		if (idx < 0) {
+			leaf = FibNode(t, key, len, route);
+			if (leaf < 0) {
+				return -1;
+			}
+			*FIB_SLOT(t, parent, side) = leaf;
+			break;
+		}
+		n = &t->nodes[idx];
+		diff = key ^ n->key;
+		common = diff ? __builtin_clz(diff) : 32;
+		if (common > len) {
+			common = len;
+		}
+		if (common > n->len) {
+			common = n->len;
+		}
+
+		if (common < n->len) {
+			/* split: a node for the common part above both */
+			mid = FibNode(t, key, common, common == len ? route : -1);
+			if (mid < 0) {
+				return -1;
+			}
+			t->nodes[mid].child[FIB_BIT(t->nodes[idx].key, common)] = idx;
+			if (common < len) {
+				leaf = FibNode(t, key, len, route);
+				if (leaf < 0) {
+					return -1;
+				}
+				t->nodes[mid].child[FIB_BIT(key, common)] = leaf;
+			}
+			*FIB_SLOT(t, parent, side) = mid;
+			break;
+		}
+		if (n->len == len) {
+			if (n->route >= 0
+			&&	t->routes[n->route].metric <= metric) {
+				return 0;
+			}
+			n->route = route;
+			break;
+		}
+		parent = idx;
+		side = FIB_BIT(key, n->len);
+	}
+	t->nroutes++;
+	return 0;
+}
+
+/* The longest prefix matching addr, host order; -1 if none */
+static int
+FibLookup (struct fib *t, uint32_t addr, int *len)
+{
+	int	idx = t->root, best = -1;
+	struct fib_node	*n;
+
+	while (idx >= 0) {
+		n = &t->nodes[idx];
+		if ((addr & FIB_MASK(n->len)) != n->key) {
+			break;
+		}
+		if (n->route >= 0) {
+			best = n->route;
+			*len = n->len;
+		}
+		if (n->len == 32) {
+			break;
+		}
+		idx = n->child[FIB_BIT(addr, n->len)];
+	}
+	return best;
+}
+
+static int
+FibRouteMsg (struct nlmsghdr *nh, void *arg)
+{
+	struct fib	*t = arg;
+	struct rtmsg	*rtm = NLMSG_DATA(nh);
+	struct rtattr	*rta;
+	int	attrlen = RTM_PAYLOAD(nh);
+	int	table = rtm->rtm_table, oif = 0;
+	uint32_t	dst = 0, metric = 0;
+
+	if (nh->nlmsg_type != RTM_NEWROUTE || rtm->rtm_family != AF_INET
+	||	t->failed) {
+		return 0;
+	}
+	for (rta = RTM_RTA(rtm); RTA_OK(rta, attrlen)
+	;	rta = RTA_NEXT(rta, attrlen)) {
+		switch (rta->rta_type) {
+		case RTA_TABLE:
+			table = *(uint32_t *)RTA_DATA(rta);
+			break;
+		case RTA_DST:
+			memcpy(&dst, RTA_DATA(rta), sizeof(dst));
+			break;
+		case RTA_OIF:
+			oif = *(int *)RTA_DATA(rta);
+			break;
+		case RTA_PRIORITY:
+			metric = *(uint32_t *)RTA_DATA(rta);
+			break;
+		case RTA_MULTIPATH:
+			/* the first hop will do for the interface */
+			if (!oif && RTA_PAYLOAD(rta) >= sizeof(struct rtnexthop)) {
+				oif = ((struct rtnexthop *)RTA_DATA(rta))->rtnh_ifindex;
+			}
+			break;
+		}
+	}
+	if (table != RT_TABLE_MAIN) {
+		return 0;
+	}
+	switch (rtm->rtm_type) {
+	case RTN_UNICAST:
+		break;
+	case RTN_UNREACHABLE:
+	case RTN_BLACKHOLE:
+	case RTN_PROHIBIT:
+		oif = 0;
+		break;
+	default:
+		return 0;
+	}
+	if (FibInsert(t, ntohl(dst), rtm->rtm_dst_len, oif, metric) < 0) {
+		t->failed = 1;
+	}
+	return 0;
+}
+
+/* The main table, NULL if it cannot be had */
+static struct fib *
+FibLoad (void)
+{
+	struct {
+		struct nlmsghdr	nh;
+		struct rtmsg	rtm;
+	} req;
+	struct fib	*t;
+	int	fd, err;
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		return NULL;
+	}
+	t->root = -1;
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd < 0) {
+		free(t);
+		return NULL;
+	}
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = sizeof(req);
+	req.nh.nlmsg_type = RTM_GETROUTE;
+	req.nh.nlmsg_flags = NLM_F_REQUEST|NLM_F_DUMP;
+	req.nh.nlmsg_seq = 1;
+	req.rtm.rtm_family = AF_INET;
+	err = NetlinkTalk(fd, &req.nh, FibRouteMsg, t);
+	close(fd);
+	if (err < 0 || t->failed) {
+		fprintf(stderr, "%s: cannot read the routing table: %s\n"
+		,	cmdname, err < 0 ? strerror(-err) : "out of memory");
+		free(t->nodes);
+		free(t->routes);
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+#endif /* __linux__ */
+
 static int
 SearchUsingProcRoute (char *address, struct in_addr *in
 , 	struct in_addr *addr_out, char *best_if, size_t best_iflen
@@ -556,119 +1190,40 @@ int ConvertQuadToInt(char *dest)
 	return netmask_bits(ntohl(ad.s_addr));
 }
 
-int
-main(int argc, char ** argv) {
-
-	char *	address = NULL;
-	char *	bcast_arg = NULL;
-	char *	netmaskbits = NULL;
-	struct in_addr	in;
-	struct in_addr	addr_out;
-	unsigned long	netmask;
-	char	best_if[MAXSTR];
-	char *	if_specified = NULL;
-	struct ifreq	ifr;
-	unsigned long	best_netmask = INT_MAX;
-	int		argerrs	= 0;
-	int		nmbits;
-
-	cmdname=argv[0];
-
-
-	memset(&addr_out, 0, sizeof(addr_out));
-	memset(&in, 0, sizeof(in));
-	memset(&ifr, 0, sizeof(ifr));
-
-	switch (argc) {
-	case 1:	/* No -C argument */
-		break;
-	case 2: /* Hopefully a -C argument */
-		if (strncmp(argv[1], "-C", sizeof("-C")) != 0) {
-			argerrs=1;
-		}
-		OutputInCIDR=1;
-		break;
-	default:
-		argerrs=1;
-		break;
-	}
-	if (argerrs) {
-		usage(OCF_ERR_ARGS);
-		/* not reached */
-		return(1);
-	}
-
-	GetAddress (&address, &netmaskbits, &bcast_arg
-	,	 &if_specified);
-	if (address == NULL || *address == EOS) {
-		fprintf(stderr, "ERROR: IP address parameter is mandatory.");
-		usage(OCF_ERR_CONFIGURED);
-		/* not reached */
-	}
-
-	/* Is the IP address we're supposed to find valid? */
-	 
-	if (inet_pton(AF_INET, address, (void *)&in) <= 0) {
-		fprintf(stderr, "IP address [%s] not valid.", address);
-		usage(OCF_ERR_CONFIGURED);
-		/* not reached */
-	}
-
-	if (netmaskbits != NULL && *netmaskbits != EOS) {
-		if (strchr(netmaskbits, '.') != NULL) {
-			nmbits = ConvertQuadToInt(netmaskbits);
-			fprintf(stderr, "Converted dotted-quad netmask to CIDR as: %d\n", nmbits);
-		}else{
-			nmbits = ConvertNetmaskBitsToInt(netmaskbits);
-		}
-
-		if (nmbits < 0) {
-			fprintf(stderr, "Invalid netmask specification"
-			" [%s]", netmaskbits);
-			usage(OCF_ERR_CONFIGURED);
-			/*not reached */
+/* Try each mechanism in turn until one works */
+static int
+SearchRoutes (char *address, struct in_addr *in, struct in_addr *addr_out
+,	char *best_if, size_t best_iflen, unsigned long *best_netmask)
+{
+	SearchRoute **sr = search_mechs;
+	char errmsg[MAXSTR] = "No valid mechanisms";
+	int rc = OCF_ERR_GENERIC;
+
+	while (*sr) {
+		errmsg[0] = '\0';
+		rc = (*sr) (address, in, addr_out, best_if
+		,	best_iflen
+		,	best_netmask, errmsg, sizeof(errmsg));
+		if (!rc) {		/* Mechanism worked */
+			break;
 		}
-
-		/* Validate the netmaskbits field */
-		ValidateNetmaskBits (nmbits, &netmask);
+		sr++;
 	}
-
-
-	if (if_specified != NULL && *if_specified != EOS) {
-		if(ValidateIFName(if_specified, &ifr) < 0) {
-			usage(OCF_ERR_CONFIGURED);
-			/* not reached */
-		}
-		strncpy(best_if, if_specified, sizeof(best_if));
-		*(best_if + sizeof(best_if) - 1) = '\0';
-	}else{
-		SearchRoute **sr = search_mechs;
-		char errmsg[MAXSTR] = "No valid mechanisms";
-		int rc = OCF_ERR_GENERIC;
-
-		strcpy(best_if, "UNKNOWN");
-
-		while (*sr) {
-			errmsg[0] = '\0';
-			rc = (*sr) (address, &in, &addr_out, best_if
-			,	sizeof(best_if)
-			,	&best_netmask, errmsg, sizeof(errmsg));
-			if (!rc) {		/* Mechanism worked */
-				break;
-			}
-			sr++;
-		}
-		if (rc != 0) {	/* No route, or all mechanisms failed */
-			if (*errmsg) {
-				fprintf(stderr, "%s", errmsg);
-			}
-			return(rc);
-		}
+	if (rc != 0 && *errmsg) {
+		fprintf(stderr, "%s", errmsg);
 	}
+	return(rc);
+}
 
-	if (netmaskbits) {
-		best_netmask = netmask;
-	}else if (best_netmask == 0L) {
+/*
+ * Print the result for address, the part common to a single lookup
+ * and the batch mode, where each line starts with the address.
+ */
+static int
+Report (char *address, struct in_addr *in, char *best_if
+,	unsigned long best_netmask, char *bcast_arg, int batch)
+{
+	if (best_netmask == 0L) {
 		/*
 		   On some distributions, there is no loopback related route
 		   item, this leads to the error here.
@@ -703,6 +1258,9 @@ main(int argc, char ** argv) {
  		}
 
 		best_netmask = htonl(best_netmask);
+		if (batch) {
+			printf("%s\t", address);
+		}
 		if (!OutputInCIDR) {
 			printf("%s\tnetmask %d.%d.%d.%d\tbroadcast %s\n"
 			,	best_if
@@ -722,7 +1280,7 @@ main(int argc, char ** argv) {
 		unsigned long	def_bcast;
 
 			/* Common broadcast address */
-		def_bcast = (in.s_addr | (~best_netmask));
+		def_bcast = (in->s_addr | (~best_netmask));
 #if DEBUG
 		fprintf(stderr, "best_netmask = %08lx, def_bcast = %08lx\n"
 		,	best_netmask,  def_bcast);
@@ -731,6 +1289,9 @@ main(int argc, char ** argv) {
 		/* Make things a bit more machine-independent */
 		best_netmask = htonl(best_netmask);
 		def_bcast = htonl(def_bcast);
+		if (batch) {
+			printf("%s\t", address);
+		}
 		if (!OutputInCIDR) {
 			printf("%s\tnetmask %d.%d.%d.%d\tbroadcast %d.%d.%d.%d\n"
 			,       best_if
@@ -755,16 +1316,249 @@ main(int argc, char ** argv) {
 	return(0);
 }
 
+/*
+ * -b: ip[/netmask] per line on stdin, each answered by a line as
+ * without -b, after the address.  Errors go to stderr, the exit code
+ * is that of the last failed address.
+ */
+static int
+FindBatch (void)
+{
+	char	line[MAXSTR], best_if[MAXSTR], *address, *mask, *end;
+	struct in_addr	in, addr_out;
+	unsigned long	best_netmask, netmask;
+	int	rc = OCF_SUCCESS, ret, nmbits;
+#ifdef __linux__
+	struct fib	*t = FibLoad();
+	struct {
+		int	oif;
+		char	name[IF_NAMESIZE];
+	} names[64];
+	int	nnames = 0, r, len = 0, j;
+#endif
+
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		address = line + strspn(line, " \t");
+		end = address + strcspn(address, " \t\r\n#");
+		*end = EOS;
+		if (*address == EOS) {
+			continue;
+		}
+		mask = strchr(address, DELIM);
+		if (mask != NULL) {
+			*mask++ = EOS;
+		}
+#ifdef __linux__
+		if (strchr(address, ':') != NULL) {
+			ret = FindInet6(address, mask, NULL, NULL, 1);
+			if (ret != 0) {
+				rc = ret;
+			}
+			continue;
+		}
+#endif
+		if (mask != NULL) {
+			nmbits = strchr(mask, '.') != NULL
+			?	ConvertQuadToInt(mask) : ConvertNetmaskBitsToInt(mask);
+			if (nmbits < 1 || nmbits > 32) {
+				fprintf(stderr, "%s: invalid netmask specification"
+				" [%s]\n", address, mask);
+				rc = OCF_ERR_CONFIGURED;
+				continue;
+			}
+			ValidateNetmaskBits(nmbits, &netmask);
+		}
+		if (inet_pton(AF_INET, address, &in) <= 0) {
+			fprintf(stderr, "IP address [%s] not valid.\n", address);
+			rc = OCF_ERR_CONFIGURED;
+			continue;
+		}
+
+		strcpy(best_if, "UNKNOWN");
+		best_netmask = 0;
+#ifdef __linux__
+		if (t != NULL) {
+			r = FibLookup(t, ntohl(in.s_addr), &len);
+			if (r < 0 || t->routes[r].oif == 0) {
+				fprintf(stderr, "No route to %s\n", address);
+				rc = OCF_ERR_GENERIC;
+				continue;
+			}
+			for (j = 0; j < nnames; j++) {
+				if (names[j].oif == t->routes[r].oif) {
+					break;
+				}
+			}
+			if (j == nnames) {
+				if (nnames == 64) {	/* start over */
+					j = nnames = 0;
+				}
+				if (if_indextoname(t->routes[r].oif, names[j].name) == NULL) {
+					fprintf(stderr, "%s: no interface %d\n"
+					,	address, t->routes[r].oif);
+					rc = OCF_ERR_GENERIC;
+					continue;
+				}
+				names[j].oif = t->routes[r].oif;
+				nnames++;
+			}
+			strcpy(best_if, names[j].name);
+			best_netmask = htonl(FIB_MASK(len));
+		}else
+#endif
+		{
+			ret = SearchRoutes(address, &in, &addr_out, best_if
+			,	sizeof(best_if), &best_netmask);
+			if (ret != 0) {
+				rc = ret;
+				continue;
+			}
+		}
+
+		if (mask != NULL) {
+			best_netmask = netmask;
+		}
+		ret = Report(address, &in, best_if, best_netmask, NULL, 1);
+		if (ret != 0) {
+			rc = ret;
+		}
+	}
+	return(rc);
+}
+
+int
+main(int argc, char ** argv) {
+
+	char *	address = NULL;
+	char *	bcast_arg = NULL;
+	char *	netmaskbits = NULL;
+	struct in_addr	in;
+	struct in_addr	addr_out;
+	unsigned long	netmask;
+	char	best_if[MAXSTR];
+	char *	if_specified = NULL;
+	struct ifreq	ifr;
+	unsigned long	best_netmask = INT_MAX;
+	int		argerrs	= 0;
+	int		batch = 0;
+	int		nmbits;
+	int		i;
+
+	cmdname=argv[0];
+
+
+	memset(&addr_out, 0, sizeof(addr_out));
+	memset(&in, 0, sizeof(in));
+	memset(&ifr, 0, sizeof(ifr));
+
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "-C", sizeof("-C")) == 0) {
+			OutputInCIDR=1;
+		}else if (strncmp(argv[i], "-b", sizeof("-b")) == 0) {
+			batch=1;
+		}else{
+			argerrs=1;
+		}
+	}
+	if (argerrs) {
+		usage(OCF_ERR_ARGS);
+		/* not reached */
+		return(1);
+	}
+	if (batch) {
+		return FindBatch();
+	}
+
+	GetAddress (&address, &netmaskbits, &bcast_arg
+	,	 &if_specified);
+	if (address == NULL || *address == EOS) {
+		fprintf(stderr, "ERROR: IP address parameter is mandatory.");
+		usage(OCF_ERR_CONFIGURED);
+		/* not reached */
+	}
+
+	if (strchr(address, ':') != NULL) {
+#ifdef __linux__
+		return FindInet6(address, netmaskbits, if_specified, bcast_arg, 0);
+#else
+		fprintf(stderr, "IPv6 address [%s] not supported here.\n"
+		,	address);
+		return(OCF_ERR_UNIMPLEMENTED);
+#endif
+	}
+
+	/* Is the IP address we're supposed to find valid? */
+	 
+	if (inet_pton(AF_INET, address, (void *)&in) <= 0) {
+		fprintf(stderr, "IP address [%s] not valid.", address);
+		usage(OCF_ERR_CONFIGURED);
+		/* not reached */
+	}
+
+	if (netmaskbits != NULL && *netmaskbits != EOS) {
+		if (strchr(netmaskbits, '.') != NULL) {
+			nmbits = ConvertQuadToInt(netmaskbits);
+			fprintf(stderr, "Converted dotted-quad netmask to CIDR as: %d\n", nmbits);
+		}else{
+			nmbits = ConvertNetmaskBitsToInt(netmaskbits);
+		}
+
+		if (nmbits < 0) {
+			fprintf(stderr, "Invalid netmask specification"
+			" [%s]", netmaskbits);
+			usage(OCF_ERR_CONFIGURED);
+			/*not reached */
+		}
+
+		/* Validate the netmaskbits field */
+		ValidateNetmaskBits (nmbits, &netmask);
+	}
+
+
+	if (if_specified != NULL && *if_specified != EOS) {
+		if(ValidateIFName(if_specified, &ifr) < 0) {
+			usage(OCF_ERR_CONFIGURED);
+			/* not reached */
+		}
+		strncpy(best_if, if_specified, sizeof(best_if));
+		*(best_if + sizeof(best_if) - 1) = '\0';
+	}else{
+		int rc;
+
+		strcpy(best_if, "UNKNOWN");
+		rc = SearchRoutes(address, &in, &addr_out, best_if
+		,	sizeof(best_if), &best_netmask);
+		if (rc != 0) {	/* No route, or all mechanisms failed */
+			return(rc);
+		}
+	}
+
+	if (netmaskbits) {
+		best_netmask = netmask;
+	}
+	return Report(address, &in, best_if, best_netmask, bcast_arg, 0);
+}
+
 void
 usage(int ec)
 {
 	fprintf(stderr, "\n"
 		"%s version 2.99.1 Copyright Alan Robertson\n"
 		"\n"
-		"Usage: %s [-C]\n"
+		"Usage: %s [-C] [-b]\n"
 		"Options:\n"
 		"    -C: Output netmask as the number of bits rather "
 			"than as 4 octets.\n"
+		"    -b: Read ip[/netmask] lines from stdin and answer "
+			"each, after the address;\n"
+		"        the environment is not used then.\n"
+		"        IPv4 answers come from the main routing table alone, "
+			"without policy rules\n"
+		"        or the local table, so for 127/8 and addresses routed "
+			"by ip rules they\n"
+		"        can differ from the answer without -b.\n"
+		"        IPv6 addresses are answered with the netmask "
+			"always in bits.\n"
 		"Environment variables:\n"
 		"OCF_RESKEY_ip		 ip address (mandatory!)\n"
 		"OCF_RESKEY_cidr_netmask netmask of interface\n"
@@ -12,6 +12,8 @@
 #include <stdlib.h>
 #include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <linux/sockios.h>
 #include <sys/file.h>
 #include <sys/time.h>
@@ -20,8 +22,19 @@
 #include <linux/if.h>
 #include <linux/if_packet.h>
 #include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
 #include <net/if_arp.h>
 #include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
 
 #include <netdb.h>
 #include <unistd.h>
@@ -37,111 +50,1532 @@ static void usage(void) __attribute__((noreturn));
 static int quit_on_reply;
 static char *device;
 static int ifindex;
+
+/*
+ * With several -I devices the socket is bound to none of them and
+ * every announcement goes out on each; device, ifindex, me and he
+ * are those of the first one.
+ */
+struct arp_if {
+	char *device;
+	int ifindex;
+	struct sockaddr_ll me, he;
+	int up;			/* announcing: operstate is up */
+};
+static struct arp_if *ifs;
+static int nifs;
 static char *source;
 static struct in_addr src, dst;
-static char *target;
+
+/*
+ * The addresses announced in unsolicited mode, or probed by a DAD
+ * scan; dst is the first one.
+ */
+struct arp_target {
+	struct in_addr ip;
+	unsigned char mac[8];	/* sender hw address, if given */
+	int maclen;
+	int conflicts;		/* DAD scan: replies from others */
+	unsigned char peer[8];	/* ... and the first one's hw address */
+	int resolved;		/* warm-up: in the neighbour table */
+};
+static struct arp_target *targets;
+static int ntargets;
+
+/* Neighbour table warm-up: the targets are peers to resolve */
+static int warmup = 0;
+static char *peerfile;
+/* sequence number of the running dump, above those of the targets */
+static __u32 dump_seq;
+static int ndumps;
+
+/* DAD scan and warm-up: index+1 of the target of each address */
+static int scan = 0;
+static int *scan_hash;
+static unsigned int scan_mask;
+
+#define SEND_BATCH	64	/* packets per sendmmsg() */
+
+/*
+ * The announcements of a round, built once: one frame per device and
+ * target, ready to be handed to sendmmsg() as they are.
+ */
+struct arp_frames {
+	int n;
+	unsigned char (*buf)[256];
+	struct iovec *iov;
+	struct mmsghdr *msg;
+};
+static struct arp_frames requests, replies;
+
+/*
+ * -S: n announcements, the i-th followed by ms[i] msecs of silence;
+ * the last one only times the reply of a pair.
+ */
+struct arp_schedule {
+	int n;
+	int *ms;
+};
+static struct arp_schedule schedule;
+
+#define SCHEDULE_MAX	100000	/* announcements */
+
+/* The resident announcer (-R) and its clients (-C, -X) */
+static char *resident_path;
+static char *announcer;
+static char *cancel_ips;
+
+#define WATCH_LISTEN	0
+#define WATCH_SIGNAL	1
+#define WATCH_CONN	2
+#define WATCH_JOB	3
+
+/* What an epoll event of the announcer is about */
+struct arp_watch {
+	int fd;			/* -1 once gone */
+	int kind;
+};
+
+/* A device with its packet socket, kept open between requests */
+struct arp_port {
+	struct arp_if ifc;
+	int fd;
+	struct arp_port *next;
+};
+static struct arp_port *ports;
+
+/* An announcement in progress: frames per port, a timer of its own */
+struct arp_job {
+	struct arp_watch w;
+	char *ips;		/* as requested, to cancel it by */
+	int interval, count, tick;
+	struct arp_schedule sched;
+	struct arp_target *targets;
+	int ntargets;
+	struct arp_port **ports;
+	struct arp_frames *requests, *replies;
+	int nports;
+	struct arp_job *next;
+};
+static struct arp_job *jobs, *reaped;
+
+struct arp_conn {
+	struct arp_watch w;
+	int len;
+	char buf[4096];
+};
+
+/* heartbeat mode: a request and, half an interval later, a reply */
+static int pairs = 0;
+static char *pidfile;
 static int dad = 0, unsolicited = 0, advert = 0;
 static int quiet = 0;
 static int count = -1;
-static int timeout = 0;
+static int timeout = 0;		/* msecs */
+static int interval = 1000;	/* msecs */
+static int tick, rounds;
 static int unicasting = 0;
 static int s = 0;
+static int epfd = -1, tfd = -1, sfd = -1, lfd = -1;
+
+/*
+ * Announcements start once every device is up, and start over when
+ * one of them comes back after going down.  Meanwhile the timer is
+ * off, for at most LINK_WAIT msecs, or -w.
+ */
+#define LINK_WAIT	10000
+static int link_waiting = 0;
+static struct timespec link_deadline;
 static int broadcast_only = 0;
 
 static struct sockaddr_ll me;
 static struct sockaddr_ll he;
 
 static struct timeval start, last;
+static struct timespec deadline;
 
 static int sent, brd_sent;
 static int received, brd_recv, req_recv;
 
+/*
+ * Round trip times of the probe mode in usecs: log-linear buckets,
+ * RTT_SUB of them per power of two, so a percentile is off by less
+ * than 1/RTT_SUB.
+ */
+#define RTT_SUB		16
+static unsigned int rtt_hist[32 * RTT_SUB];
+static int rtt_n;
+static long rtt_min, rtt_max;
+static long long rtt_sum;
+static int json = 0;
+
 #define MS_TDIFF(tv1,tv2) ( ((tv1).tv_sec-(tv2).tv_sec)*1000 + \
 			   ((tv1).tv_usec-(tv2).tv_usec)/1000 )
 
-static void print_hex(unsigned char *p, int len);
-static int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM);
-static void set_signal(int signo, void (*handler)(void));
-static int send_pack(int s, struct in_addr src, struct in_addr dst,
-	      struct sockaddr_ll *ME, struct sockaddr_ll *HE);
-static void finish(void);
-static void catcher(void);
+static void print_hex(unsigned char *p, int len);
+static void rtt_add(long usecs);
+static long rtt_bucket_max(int i);
+static long rtt_percentile(int pct);
+static void print_rtt(void);
+static int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM);
+static int build_pack(unsigned char *buf, int op, struct in_addr src,
+		      struct in_addr dst, const unsigned char *sha,
+		      struct sockaddr_ll *ME, struct sockaddr_ll *HE);
+static int send_pack(int s, struct in_addr src, struct in_addr dst,
+	      struct sockaddr_ll *ME, struct sockaddr_ll *HE);
+static void build_frames(struct arp_frames *fr, int op, struct arp_if *ifv, int nif,
+			 struct arp_target *tv, int nt);
+static void free_frames(struct arp_frames *fr);
+static int send_frames(int s, struct arp_frames *fr);
+static void attach_filter(int s);
+static void scan_init(void);
+static struct arp_target *scan_find(struct in_addr ip);
+static int recv_scan(unsigned char *buf, int len, struct sockaddr_ll *FROM);
+static int scan_report(void);
+static void read_peers(const char *path);
+static int neigh_dump(int nl);
+static int neigh_recv(int nl, int *done);
+static int neigh_update(int nl, int ms);
+static int warm_neighbours(void);
+static int resident_watch_add(struct arp_watch *w);
+static struct arp_port *port_get(const char *name, char *err, size_t errlen);
+static void job_free(struct arp_job *j);
+static void job_reap(void);
+static int job_cancel(const char *ips);
+static int job_send(struct arp_job *j);
+static void job_tick(struct arp_job *j);
+static int job_start(char *args, char *err, size_t errlen);
+static void conn_request(struct arp_conn *c);
+static void conn_input(struct arp_conn *c);
+static void resident_cleanup(void);
+static void resident_loop(void) __attribute__((noreturn));
+static int resident_request(const char *path, const char *line);
+static void write_pidfile(void);
+static void remove_pidfile(void);
+static void add_devices(char *names);
+static int parse_mac(const char *str, unsigned char *mac);
+static int parse_ms(const char *str, long *ms);
+static int parse_schedule(const char *spec, struct arp_schedule *sc,
+			  char *err, size_t errlen);
+static int schedule_arm(int fd, int n, int halves, struct arp_schedule *sc);
+static void add_targets(char *ips, char *macs);
+static void finish(void);
+static int link_open(void);
+static int link_recv(int nl, int *done);
+static void link_update(void);
+static int link_wait_left(void);
+static void timer_start(void);
+static void announce_start(void);
+static void catcher(void);
+static void set_deadline(void);
+static int timeout_left(void);
+static int event_add(int fd);
+static void event_setup(void);
+static void event_loop(void) __attribute__((noreturn));
+
+void usage(void)
+{
+	fprintf(stderr,
+		"Usage: arping [-fqjbDUAV] [-c count] [-w timeout] [-I device] [-s source] destination\n"
+		"       arping -D [-c count] [-w timeout] [-i interval] [-I device] destination...\n"
+		"       arping -N [-w timeout] [-I device] [-F file] [destination...]\n"
+		"       arping -U|-A [-c count] [-i interval] [-I device]... destination...\n"
+		"       send_arp [-i interval] [-r count] [-S schedule] [-p pidfile] [-C socket] device[,device...] ip[,ip...] auto|mac[,mac...] bcast netmask\n"
+		"       send_arp -R socket [-p pidfile]\n"
+		"       send_arp -C socket -X ip[,ip...]\n"
+		"  -f : quit on first reply\n"
+		"  -q : be quiet\n"
+		"  -j : print the statistics as JSON and nothing else (implies -q)\n"
+		"  -b : keep broadcasting, don't go unicast\n"
+		"  -D : duplicate address detection mode; with several destinations\n"
+		"       all of them are probed at once and every one in use reported\n"
+		"  -U : Unsolicited ARP mode, update your neighbours\n"
+		"  -A : ARP answer mode, update your neighbours\n"
+		"       -U and -A wait for the link to be up and start over when\n"
+		"       it flaps\n"
+		"  -V : print version and exit\n"
+		"  -c count : how many packets to send\n"
+		"  -w timeout : how long to wait for a reply (secs, may be fractional)\n"
+		"  -i interval : msecs between two packets (1000)\n"
+		"  -S count@interval[,backoff=factor][,max=interval][,total=time] :\n"
+		"              a burst of count packets, then intervals growing by\n"
+		"              factor up to max, until total has passed; times in\n"
+		"              ms, or with an s suffix in seconds\n"
+		"  -I device : which ethernet device to use (eth0); -U and -A\n"
+		"              announce on every device given\n"
+		"  -s source : source ip address\n"
+		"  -N : resolve the destinations into the neighbour table\n"
+		"  -F file : more destinations for -N, one per line; the\n"
+		"            format of /proc/net/arp will do\n"
+		"  -R socket : stay and announce what is asked for over socket\n"
+		"  -C socket : hand the announcement to the -R instance at socket,\n"
+		"              or do it ourselves if there is none\n"
+		"  -X ip : cancel the announcement of ip at the -C socket\n"
+		"  destination : ask for what ip address; in -U/-A mode all the\n"
+		"                destinations are announced in every round\n"
+		);
+	exit(2);
+}
+
+/* Fill in an ARP packet, sha is the sender hardware address */
+int build_pack(unsigned char *buf, int op, struct in_addr src,
+	       struct in_addr dst, const unsigned char *sha,
+	       struct sockaddr_ll *ME, struct sockaddr_ll *HE)
+{
+	struct arphdr *ah = (struct arphdr*)buf;
+	unsigned char *p = (unsigned char *)(ah+1);
+
+	ah->ar_hrd = htons(ME->sll_hatype);
+	if (ah->ar_hrd == htons(ARPHRD_FDDI))
+		ah->ar_hrd = htons(ARPHRD_ETHER);
+	ah->ar_pro = htons(ETH_P_IP);
+	ah->ar_hln = ME->sll_halen;
+	ah->ar_pln = 4;
+	ah->ar_op  = htons(op);
+
+	memcpy(p, sha, ah->ar_hln);
+	p+=ME->sll_halen;
+
+	memcpy(p, &src, 4);
+	p+=4;
+
+	if (op == ARPOP_REPLY)
+		memcpy(p, sha, ah->ar_hln);
+	else
+		memcpy(p, &HE->sll_addr, ah->ar_hln);
+	p+=ah->ar_hln;
+
+	memcpy(p, &dst, 4);
+	p+=4;
+
+	return p-buf;
+}
+
+int send_pack(int s, struct in_addr src, struct in_addr dst,
+	      struct sockaddr_ll *ME, struct sockaddr_ll *HE)
+{
+	int err, len;
+	struct timeval now;
+	unsigned char buf[256];
+
+	len = build_pack(buf, advert ? ARPOP_REPLY : ARPOP_REQUEST,
+			 src, dst, ME->sll_addr, ME, HE);
+
+	gettimeofday(&now, NULL);
+	err = sendto(s, buf, len, 0, (struct sockaddr*)HE, sizeof(*HE));
+	if (err == len) {
+		last = now;
+		sent++;
+		if (!unicasting)
+			brd_sent++;
+	}
+	return err;
+}
+
+/* One frame of type op for every target in tv on every device in ifv */
+void build_frames(struct arp_frames *fr, int op, struct arp_if *ifv, int nif,
+		  struct arp_target *tv, int nt)
+{
+	struct arp_target *t;
+	struct arp_if *ifp;
+	int i;
+
+	fr->n = nif * nt;
+	fr->buf = calloc(fr->n, sizeof(*fr->buf));
+	fr->iov = calloc(fr->n, sizeof(*fr->iov));
+	fr->msg = calloc(fr->n, sizeof(*fr->msg));
+	if (!fr->buf || !fr->iov || !fr->msg) {
+		perror("arping: calloc");
+		exit(2);
+	}
+
+	for (i = 0; i < fr->n; i++) {
+		t = &tv[i % nt];
+		ifp = &ifv[i / nt];
+		fr->iov[i].iov_base = fr->buf[i];
+		fr->iov[i].iov_len = build_pack(fr->buf[i], op,
+						source || dad ? src : t->ip, t->ip,
+						t->maclen ? t->mac : ifp->me.sll_addr,
+						&ifp->me, &ifp->he);
+		fr->msg[i].msg_hdr.msg_name = &ifp->he;
+		fr->msg[i].msg_hdr.msg_namelen = sizeof(ifp->he);
+		fr->msg[i].msg_hdr.msg_iov = &fr->iov[i];
+		fr->msg[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+void free_frames(struct arp_frames *fr)
+{
+	free(fr->buf);
+	free(fr->iov);
+	free(fr->msg);
+	memset(fr, 0, sizeof(*fr));
+}
+
+/* One round of announcements, SEND_BATCH packets per system call */
+int send_frames(int s, struct arp_frames *fr)
+{
+	struct timeval now;
+	int n, done, ret;
+
+	gettimeofday(&now, NULL);
+	for (done = 0; done < fr->n; done += ret) {
+		n = fr->n - done;
+		if (n > SEND_BATCH)
+			n = SEND_BATCH;
+		ret = sendmmsg(s, fr->msg + done, n, 0);
+		if (ret <= 0) {
+			int err = errno;
+
+			perror("arping: sendmmsg");
+			errno = err;
+			return -1;
+		}
+		sent += ret;
+		brd_sent += ret;
+	}
+	last = now;
+	return 0;
+}
+
+/*
+ * Let the kernel drop what recv_pack() would ignore anyway: frames
+ * not for us, anything but IPv4 requests and replies of our hardware
+ * type, and answers from other addresses than dst.  The remaining
+ * checks stay in recv_pack().
+ */
+void attach_filter(int s)
+{
+	unsigned int hrd = me.sll_hatype == ARPHRD_FDDI ? ARPHRD_ETHER : me.sll_hatype;
+	struct sock_filter code[] = {
+		/* 0 */ BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+		/* 1 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, PACKET_HOST, 2, 0),
+		/* 2 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, PACKET_BROADCAST, 1, 0),
+		/* 3 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, PACKET_MULTICAST, 0, 15),
+		/* 4 */ BPF_STMT(BPF_LD|BPF_H|BPF_ABS, offsetof(struct arphdr, ar_pro)),
+		/* 5 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ETH_P_IP, 0, 13),
+		/* 6 */ BPF_STMT(BPF_LD|BPF_B|BPF_ABS, offsetof(struct arphdr, ar_hln)),
+		/* 7 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, me.sll_halen, 0, 11),
+		/* 8 */ BPF_STMT(BPF_LD|BPF_B|BPF_ABS, offsetof(struct arphdr, ar_pln)),
+		/* 9 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, 4, 0, 9),
+		/* 10 */ BPF_STMT(BPF_LD|BPF_H|BPF_ABS, offsetof(struct arphdr, ar_hrd)),
+		/* 11 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, me.sll_hatype, 1, 0),
+		/* 12 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, hrd, 0, 6),
+		/* 13 */ BPF_STMT(BPF_LD|BPF_H|BPF_ABS, offsetof(struct arphdr, ar_op)),
+		/* 14 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ARPOP_REQUEST, 1, 0),
+		/* 15 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ARPOP_REPLY, 0, 3),
+		/* sender protocol address */
+		/* 16 */ BPF_STMT(BPF_LD|BPF_W|BPF_ABS, sizeof(struct arphdr) + me.sll_halen),
+		/* 17 */ BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ntohl(dst.s_addr), 0, 1),
+		/* 18 */ BPF_STMT(BPF_RET|BPF_K, 0xffff),
+		/* 19 */ BPF_STMT(BPF_RET|BPF_K, 0),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(code)/sizeof(code[0]),
+		.filter = code,
+	};
+
+	/* a scan looks the sender up in scan_hash instead */
+	if (scan)
+		code[16] = (struct sock_filter)BPF_STMT(BPF_RET|BPF_K, 0xffff);
+
+	if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1)
+		perror("WARNING: setsockopt(SO_ATTACH_FILTER)");
+}
+
+/*
+ * Open addressing with linear probing, at most half full; addresses
+ * given twice are only probed once.
+ */
+void scan_init(void)
+{
+	unsigned int size = 2, h;
+	int i, n = 0;
+
+	while (size < 2 * (unsigned int)ntargets)
+		size <<= 1;
+	scan_hash = calloc(size, sizeof(*scan_hash));
+	if (!scan_hash) {
+		perror("arping: calloc");
+		exit(2);
+	}
+	scan_mask = size - 1;
+
+	for (i = 0; i < ntargets; i++) {
+		if (scan_find(targets[i].ip))
+			continue;
+		targets[n] = targets[i];
+		h = (ntohl(targets[n].ip.s_addr) * 2654435761U) & scan_mask;
+		while (scan_hash[h])
+			h = (h + 1) & scan_mask;
+		scan_hash[h] = ++n;
+	}
+	ntargets = n;
+}
+
+struct arp_target *scan_find(struct in_addr ip)
+{
+	unsigned int h = (ntohl(ip.s_addr) * 2654435761U) & scan_mask;
+
+	while (scan_hash[h]) {
+		if (targets[scan_hash[h] - 1].ip.s_addr == ip.s_addr)
+			return &targets[scan_hash[h] - 1];
+		h = (h + 1) & scan_mask;
+	}
+	return NULL;
+}
+
+/* recv_pack() for a scan: the DAD checks against every target */
+int recv_scan(unsigned char *buf, int len, struct sockaddr_ll *FROM)
+{
+	struct arphdr *ah = (struct arphdr*)buf;
+	unsigned char *p = (unsigned char *)(ah+1);
+	struct in_addr src_ip, dst_ip;
+	struct arp_target *t;
+
+	if (FROM->sll_pkttype != PACKET_HOST &&
+	    FROM->sll_pkttype != PACKET_BROADCAST &&
+	    FROM->sll_pkttype != PACKET_MULTICAST)
+		return 0;
+	if (len < sizeof(*ah) + 2*(4 + me.sll_halen) ||
+	    ah->ar_hln != me.sll_halen || ah->ar_pln != 4 ||
+	    ah->ar_pro != htons(ETH_P_IP) ||
+	    (ah->ar_op != htons(ARPOP_REQUEST) && ah->ar_op != htons(ARPOP_REPLY)))
+		return 0;
+	memcpy(&src_ip, p+ah->ar_hln, 4);
+	memcpy(&dst_ip, p+ah->ar_hln+4+ah->ar_hln, 4);
+
+	t = scan_find(src_ip);
+	if (!t)
+		return 0;
+	if (memcmp(p, &me.sll_addr, me.sll_halen) == 0)
+		return 0;
+	if (src.s_addr && src.s_addr != dst_ip.s_addr)
+		return 0;
+
+	if (!t->conflicts++)
+		memcpy(t->peer, p, me.sll_halen);
+	received++;
+	if (FROM->sll_pkttype != PACKET_HOST)
+		brd_recv++;
+	if (ah->ar_op == htons(ARPOP_REQUEST))
+		req_recv++;
+	return 1;
+}
+
+/* The addresses found in use, after the whole scan */
+int scan_report(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < ntargets; i++) {
+		if (!targets[i].conflicts)
+			continue;
+		n++;
+		if (quiet)
+			continue;
+		printf("%s in use by [", inet_ntoa(targets[i].ip));
+		print_hex(targets[i].peer, me.sll_halen);
+		printf("] (%d response(s))\n", targets[i].conflicts);
+	}
+	if (!quiet)
+		printf("Scanned %d address(es), %d in use\n", ntargets, n);
+	return n;
+}
+
+/* Addresses of peers, in the first column; other lines are skipped */
+void read_peers(const char *path)
+{
+	FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	char line[256], *ip;
+	struct arp_target *t;
+	struct in_addr addr;
+
+	if (!f) {
+		fprintf(stderr, "arping: cannot read %s: %s\n", path, strerror(errno));
+		exit(2);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		ip = strtok(line, " \t\n");
+		if (!ip || inet_aton(ip, &addr) != 1)
+			continue;
+		t = realloc(targets, (ntargets + 1) * sizeof(*targets));
+		if (!t) {
+			perror("arping: realloc");
+			exit(2);
+		}
+		targets = t;
+		memset(&targets[ntargets], 0, sizeof(*targets));
+		targets[ntargets++].ip = addr;
+	}
+	if (f != stdin)
+		fclose(f);
+}
+
+/*
+ * Marks the targets that are in the neighbour table of our device in
+ * a usable state.  Works on dumps and on RTM_NEWNEIGH notifications
+ * alike; returns how many got resolved, -1 on errors.  The end of a
+ * dump sets done, so does its failure.
+ */
+int neigh_recv(int nl, int *done)
+{
+	char buf[16384];
+	struct nlmsghdr *nh;
+	struct ndmsg *ndm;
+	struct rtattr *rta;
+	struct arp_target *t;
+	int len, attrlen, n = 0;
+
+	len = recv(nl, buf, sizeof(buf), 0);
+	if (len < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+	for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+		if (nh->nlmsg_type == NLMSG_DONE) {
+			if (done)
+				*done = 1;
+			return n;
+		}
+		if (nh->nlmsg_type == NLMSG_ERROR) {
+			struct nlmsgerr *err = NLMSG_DATA(nh);
+
+			if (err->error && nh->nlmsg_seq == dump_seq) {
+				if (done)
+					*done = 1;
+				errno = -err->error;
+				return -1;
+			}
+			if (err->error && nh->nlmsg_seq >= 1 &&
+			    nh->nlmsg_seq <= (__u32)ntargets && !quiet)
+				fprintf(stderr, "arping: %s: %s\n",
+					inet_ntoa(targets[nh->nlmsg_seq - 1].ip),
+					strerror(-err->error));
+			continue;
+		}
+		if (nh->nlmsg_type != RTM_NEWNEIGH)
+			continue;
+		ndm = NLMSG_DATA(nh);
+		if (ndm->ndm_family != AF_INET || ndm->ndm_ifindex != ifindex ||
+		    !(ndm->ndm_state & (NUD_REACHABLE|NUD_STALE|NUD_DELAY|NUD_PROBE|NUD_PERMANENT)))
+			continue;
+
+		attrlen = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*ndm));
+		for (rta = (struct rtattr *)((char *)ndm + NLMSG_ALIGN(sizeof(*ndm)));
+		     RTA_OK(rta, attrlen); rta = RTA_NEXT(rta, attrlen)) {
+			if (rta->rta_type != NDA_DST || RTA_PAYLOAD(rta) != 4)
+				continue;
+			t = scan_find(*(struct in_addr *)RTA_DATA(rta));
+			if (t && !t->resolved) {
+				t->resolved = 1;
+				n++;
+			}
+		}
+	}
+	return n;
+}
+
+/*
+ * What the kernel already knows.  Notifications lost meanwhile
+ * (ENOBUFS) do not matter, the dump itself is not lost.
+ */
+int neigh_dump(int nl)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct ndmsg ndm;
+	} req;
+	int n, done = 0, total = 0;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = sizeof(req);
+	req.nh.nlmsg_type = RTM_GETNEIGH;
+	req.nh.nlmsg_flags = NLM_F_REQUEST|NLM_F_DUMP;
+	req.nh.nlmsg_seq = dump_seq = ntargets + ++ndumps;
+	req.ndm.ndm_family = AF_INET;
+	if (send(nl, &req, sizeof(req), 0) < 0)
+		return -1;
+
+	while (!done) {
+		n = neigh_recv(nl, &done);
+		if (n < 0 && (done || errno != ENOBUFS))
+			return -1;
+		if (n > 0)
+			total += n;
+	}
+	return total;
+}
+
+/*
+ * Wait up to ms for notifications and take them in.  If some were
+ * lost because the socket overflowed, the table is dumped again.
+ */
+int neigh_update(int nl, int ms)
+{
+	struct pollfd pfd;
+	int n;
+
+	pfd.fd = nl;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, ms) <= 0)
+		return 0;
+	n = neigh_recv(nl, NULL);
+	if (n < 0 && errno == ENOBUFS)
+		n = neigh_dump(nl);
+	return n;
+}
+
+/*
+ * Have the kernel resolve every peer that it does not know yet: an
+ * RTM_NEWNEIGH with NTF_USE starts the resolution just like outgoing
+ * traffic would, so the replies land in the neighbour table.  The
+ * requests go out in as few sendmsg() calls as fit, then we wait for
+ * the RTM_NEWNEIGH notifications until all are resolved or -w is up.
+ * They are not acknowledged; only failures are answered.  The
+ * notifications are read between batches, before they overflow.
+ */
+int warm_neighbours(void)
+{
+	static char buf[32768];
+	struct nlmsghdr *nh;
+	struct ndmsg *ndm;
+	struct rtattr *rta;
+	struct sockaddr_nl snl;
+	int nl, i, len, ms, sent_reqs = 0, resolved = 0, known, n;
+
+	nl = socket(AF_NETLINK, SOCK_RAW|SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (nl < 0) {
+		perror("arping: netlink socket");
+		return 2;
+	}
+	/* notifications may come in during the dump, that is fine */
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = RTMGRP_NEIGH;
+	if (bind(nl, (struct sockaddr *)&snl, sizeof(snl)) < 0) {
+		perror("arping: netlink bind");
+		return 2;
+	}
+
+	known = neigh_dump(nl);
+	if (known < 0) {
+		perror("arping: RTM_GETNEIGH");
+		return 2;
+	}
+	resolved = known;
+
+	len = 0;
+	for (i = 0; i <= ntargets; i++) {
+		if (i < ntargets && targets[i].resolved)
+			continue;
+		if (len && (i == ntargets ||
+			    len + NLMSG_SPACE(sizeof(*ndm) + RTA_SPACE(4)) > sizeof(buf))) {
+			if (send(nl, buf, len, 0) < 0) {
+				perror("arping: RTM_NEWNEIGH");
+				return 2;
+			}
+			len = 0;
+			while ((n = neigh_update(nl, 0)) > 0)
+				resolved += n;
+			if (n < 0) {
+				perror("arping: netlink recv");
+				return 2;
+			}
+		}
+		if (i == ntargets)
+			break;
+
+		nh = (struct nlmsghdr *)(buf + len);
+		memset(nh, 0, NLMSG_SPACE(sizeof(*ndm) + RTA_SPACE(4)));
+		nh->nlmsg_len = NLMSG_LENGTH(sizeof(*ndm) + RTA_SPACE(4));
+		nh->nlmsg_type = RTM_NEWNEIGH;
+		nh->nlmsg_flags = NLM_F_REQUEST|NLM_F_CREATE|NLM_F_REPLACE;
+		nh->nlmsg_seq = i + 1;
+		ndm = NLMSG_DATA(nh);
+		ndm->ndm_family = AF_INET;
+		ndm->ndm_ifindex = ifindex;
+		ndm->ndm_state = NUD_NONE;
+		ndm->ndm_flags = NTF_USE;
+		rta = (struct rtattr *)((char *)ndm + NLMSG_ALIGN(sizeof(*ndm)));
+		rta->rta_type = NDA_DST;
+		rta->rta_len = RTA_LENGTH(4);
+		memcpy(RTA_DATA(rta), &targets[i].ip, 4);
+		len += NLMSG_ALIGN(nh->nlmsg_len);
+		sent_reqs++;
+	}
+
+	if (!timeout)
+		timeout = 1000;
+	set_deadline();
+	while (resolved < ntargets && (ms = timeout_left()) != 0) {
+		n = neigh_update(nl, ms);
+		if (n < 0) {
+			perror("arping: netlink recv");
+			break;
+		}
+		resolved += n;
+	}
+	close(nl);
+
+	if (!quiet) {
+		printf("Resolved %d of %d peer(s) (%d known before, %d requested)\n",
+		       resolved, ntargets, known, sent_reqs);
+		for (i = 0; i < ntargets; i++)
+			if (!targets[i].resolved)
+				printf("No answer from %s\n", inet_ntoa(targets[i].ip));
+	}
+	return resolved == ntargets ? 0 : 1;
+}
+
+/*
+ * Resident announcer (-R): IPaddr2 hands its announcements over a
+ * Unix socket instead of starting send_arp for each.  One request
+ * per connection, one line each way:
+ *
+ *   announce <interval|schedule> <count> <device[,...]> <ip[,...]> <auto|mac[,...]>
+ *   cancel <ip[,...]>
+ *
+ * answered by "ok" or "error <reason>".  An announcement runs like
+ * the heartbeat mode: count pairs of request and reply, the first
+ * request before the answer.  A device that is down or has no carrier
+ * is refused, so that the client announces itself and waits for the
+ * link.
+ * Announcing the same addresses again replaces the running one.
+ * The packet socket of each device stays open between requests.
+ */
+int resident_watch_add(struct arp_watch *w)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = w;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, w->fd, &ev);
+}
+
+/*
+ * The open socket of a device, if it is still the same; a device that
+ * went away and came back gets a new one.  The link layer address is
+ * read again every time, it may have changed since.
+ */
+struct arp_port *port_get(const char *name, char *err, size_t errlen)
+{
+	struct arp_port *p, **pp;
+	struct ifreq ifr;
+	socklen_t alen;
+
+	for (pp = &ports; (p = *pp); pp = &p->next) {
+		if (strcmp(p->ifc.device, name))
+			continue;
+		alen = sizeof(p->ifc.me);
+		if (getsockname(p->fd, (struct sockaddr *)&p->ifc.me, &alen) == 0 &&
+		    p->ifc.me.sll_halen)
+			goto found;
+		*pp = p->next;
+		close(p->fd);
+		free(p->ifc.device);
+		free(p);
+		break;
+	}
+
+	p = calloc(1, sizeof(*p));
+	if (!p) {
+		snprintf(err, errlen, "%s", strerror(errno));
+		return NULL;
+	}
+	/* protocol 0: we only send, nothing is queued for us */
+	p->fd = socket(PF_PACKET, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+	if (p->fd < 0) {
+		snprintf(err, errlen, "socket: %s", strerror(errno));
+		free(p);
+		return NULL;
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, name, IFNAMSIZ-1);
+	if (ioctl(p->fd, SIOCGIFINDEX, &ifr) < 0) {
+		snprintf(err, errlen, "unknown iface %s", name);
+		goto fail;
+	}
+	p->ifc.ifindex = ifr.ifr_ifindex;
+	if (ioctl(p->fd, SIOCGIFFLAGS, &ifr) < 0) {
+		snprintf(err, errlen, "%s: %s", name, strerror(errno));
+		goto fail;
+	}
+	if (ifr.ifr_flags & (IFF_NOARP|IFF_LOOPBACK)) {
+		snprintf(err, errlen, "interface \"%s\" is not ARPable", name);
+		goto fail;
+	}
+	p->ifc.me.sll_family = AF_PACKET;
+	p->ifc.me.sll_ifindex = p->ifc.ifindex;
+	alen = sizeof(p->ifc.me);
+	if (bind(p->fd, (struct sockaddr *)&p->ifc.me, sizeof(p->ifc.me)) < 0 ||
+	    getsockname(p->fd, (struct sockaddr *)&p->ifc.me, &alen) < 0) {
+		snprintf(err, errlen, "%s: %s", name, strerror(errno));
+		goto fail;
+	}
+	if (p->ifc.me.sll_halen == 0) {
+		snprintf(err, errlen, "interface \"%s\" is not ARPable (no ll address)", name);
+		goto fail;
+	}
+	p->ifc.device = strdup(name);
+	p->next = ports;
+	ports = p;
+
+found:
+	/* up and with carrier, as link_recv() has it */
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, name, IFNAMSIZ-1);
+	if (ioctl(p->fd, SIOCGIFFLAGS, &ifr) < 0) {
+		snprintf(err, errlen, "%s: %s", name, strerror(errno));
+		return NULL;
+	}
+	if ((ifr.ifr_flags & (IFF_UP|IFF_RUNNING)) != (IFF_UP|IFF_RUNNING)) {
+		snprintf(err, errlen, "interface \"%s\" is down", name);
+		return NULL;
+	}
+	p->ifc.he = p->ifc.me;
+	p->ifc.he.sll_protocol = htons(ETH_P_ARP);
+	memset(p->ifc.he.sll_addr, -1, p->ifc.he.sll_halen);
+	return p;
+
+fail:
+	close(p->fd);
+	free(p);
+	return NULL;
+}
+
+/* Off the list now, freed once the events at hand are through */
+void job_free(struct arp_job *j)
+{
+	struct arp_job **jp;
+
+	for (jp = &jobs; *jp; jp = &(*jp)->next) {
+		if (*jp == j) {
+			*jp = j->next;
+			break;
+		}
+	}
+	if (j->w.fd >= 0)
+		close(j->w.fd);
+	j->w.fd = -1;
+	j->next = reaped;
+	reaped = j;
+}
+
+void job_reap(void)
+{
+	struct arp_job *j;
+	int i;
+
+	while ((j = reaped)) {
+		reaped = j->next;
+		for (i = 0; i < j->nports; i++) {
+			free_frames(&j->requests[i]);
+			free_frames(&j->replies[i]);
+		}
+		free(j->requests);
+		free(j->replies);
+		free(j->ports);
+		free(j->targets);
+		free(j->sched.ms);
+		free(j->ips);
+		free(j);
+	}
+}
+
+int job_cancel(const char *ips)
+{
+	struct arp_job *j, *next;
+	int n = 0;
+
+	for (j = jobs; j; j = next) {
+		next = j->next;
+		if (strcmp(j->ips, ips) == 0) {
+			job_free(j);
+			n++;
+		}
+	}
+	return n;
+}
+
+/* Requests on even ticks, replies on odd ones, as catcher() does */
+int job_send(struct arp_job *j)
+{
+	struct arp_frames *fr = j->tick % 2 ? j->replies : j->requests;
+	int i, ret = 0;
+
+	for (i = 0; i < j->nports; i++) {
+		if (send_frames(j->ports[i]->fd, &fr[i]) < 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+void job_tick(struct arp_job *j)
+{
+	uint64_t ticks;
+
+	if (read(j->w.fd, &ticks, sizeof(ticks)) != sizeof(ticks))
+		return;
+	j->tick++;
+	if (j->tick % 2 == 0)
+		j->count--;
+	job_send(j);
+	if (j->tick % 2 && j->count == 0)
+		job_free(j);
+	else if (j->sched.n && schedule_arm(j->w.fd, j->tick, 1, &j->sched) && !quiet)
+		perror("arping: timerfd_settime");
+}
+
+/* "announce ..." without the command; 0 once the first round is out */
+int job_start(char *args, char *err, size_t errlen)
+{
+	char *tok[5], *save = NULL, *item, *isave = NULL, *msave = NULL;
+	struct arp_job *j;
+	struct arp_target *t;
+	struct itimerspec its;
+	long period;
+	int i, n;
+
+	for (n = 0; n < 5; n++) {
+		tok[n] = strtok_r(n ? NULL : args, " \t", &save);
+		if (!tok[n]) {
+			snprintf(err, errlen, "usage: announce interval count devices ips macs");
+			return -1;
+		}
+	}
+
+	j = calloc(1, sizeof(*j));
+	if (!j) {
+		snprintf(err, errlen, "%s", strerror(errno));
+		return -1;
+	}
+	j->w.kind = WATCH_JOB;
+	j->w.fd = -1;
+
+	/* a schedule instead of the interval; the count may cut it short */
+	j->count = atoi(tok[1]);
+	if (strchr(tok[0], '@')) {
+		if (parse_schedule(tok[0], &j->sched, err, errlen))
+			goto fail;
+		if (j->count <= 0 || j->count > j->sched.n)
+			j->count = j->sched.n;
+	} else {
+		j->interval = atoi(tok[0]);
+		if (j->interval <= 0 || j->count <= 0) {
+			snprintf(err, errlen, "bad interval %s or count %s", tok[0], tok[1]);
+			goto fail;
+		}
+	}
+	j->ips = strdup(tok[3]);
+	if (!j->ips) {
+		snprintf(err, errlen, "%s", strerror(errno));
+		goto fail;
+	}
+
+	for (item = strtok_r(tok[3], ",", &isave); item; item = strtok_r(NULL, ",", &isave)) {
+		t = realloc(j->targets, (j->ntargets + 1) * sizeof(*t));
+		if (!t) {
+			snprintf(err, errlen, "%s", strerror(errno));
+			goto fail;
+		}
+		j->targets = t;
+		t = &t[j->ntargets++];
+		memset(t, 0, sizeof(*t));
+		if (inet_aton(item, &t->ip) != 1) {
+			snprintf(err, errlen, "invalid address %s", item);
+			goto fail;
+		}
+		if (strcmp(tok[4], "auto") == 0)
+			continue;
+		item = strtok_r(msave ? NULL : tok[4], ",", &msave);
+		if (!item || (t->maclen = parse_mac(item, t->mac)) < 0) {
+			snprintf(err, errlen, "no or invalid MAC address for %s",
+				 inet_ntoa(t->ip));
+			goto fail;
+		}
+	}
+	if (msave && strtok_r(NULL, ",", &msave)) {
+		snprintf(err, errlen, "more MAC addresses than addresses");
+		goto fail;
+	}
+
+	for (item = strtok_r(tok[2], ",", &isave); item; item = strtok_r(NULL, ",", &isave)) {
+		struct arp_port **pv = realloc(j->ports, (j->nports + 1) * sizeof(*pv));
+		struct arp_frames *rq = realloc(j->requests, (j->nports + 1) * sizeof(*rq));
+		struct arp_frames *rp = rq ? realloc(j->replies, (j->nports + 1) * sizeof(*rp)) : NULL;
+
+		if (pv)
+			j->ports = pv;
+		if (rq)
+			j->requests = rq;
+		if (rp)
+			j->replies = rp;
+		if (!pv || !rq || !rp) {
+			snprintf(err, errlen, "%s", strerror(errno));
+			goto fail;
+		}
+		memset(&j->requests[j->nports], 0, sizeof(*rq));
+		memset(&j->replies[j->nports], 0, sizeof(*rp));
+		j->ports[j->nports] = port_get(item, err, errlen);
+		if (!j->ports[j->nports])
+			goto fail;
+		for (i = 0; i < j->ntargets; i++) {
+			if (j->targets[i].maclen &&
+			    j->targets[i].maclen != j->ports[j->nports]->ifc.me.sll_halen) {
+				snprintf(err, errlen, "MAC address of %s does not fit %s",
+					 inet_ntoa(j->targets[i].ip), item);
+				goto fail;
+			}
+		}
+		build_frames(&j->requests[j->nports], ARPOP_REQUEST,
+			     &j->ports[j->nports]->ifc, 1, j->targets, j->ntargets);
+		build_frames(&j->replies[j->nports], ARPOP_REPLY,
+			     &j->ports[j->nports]->ifc, 1, j->targets, j->ntargets);
+		j->nports++;
+	}
+
+	/* the last word on these addresses wins */
+	job_cancel(j->ips);
+	j->next = jobs;
+	jobs = j;
+
+	j->count--;
+	if (job_send(j) < 0) {
+		snprintf(err, errlen, "%s", strerror(errno));
+		goto fail;
+	}
+
+	period = j->interval * 1000000L / 2;
+	memset(&its, 0, sizeof(its));
+	its.it_interval.tv_sec = period / 1000000000L;
+	its.it_interval.tv_nsec = period % 1000000000L;
+	its.it_value = its.it_interval;
+	j->w.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (j->w.fd < 0 ||
+	    (j->sched.n ? schedule_arm(j->w.fd, 0, 1, &j->sched) :
+	     timerfd_settime(j->w.fd, 0, &its, NULL)) ||
+	    resident_watch_add(&j->w)) {
+		snprintf(err, errlen, "timer: %s", strerror(errno));
+		goto fail;
+	}
+	return 0;
+
+fail:
+	job_free(j);
+	return -1;
+}
+
+/* A whole line from a client: act on it and answer */
+void conn_request(struct arp_conn *c)
+{
+	char err[256], reply[300], *cmd, *args;
+	int ret;
+
+	c->buf[c->len] = 0;
+	c->buf[strcspn(c->buf, "\r\n")] = 0;
+	cmd = c->buf + strspn(c->buf, " \t");
+	args = cmd + strcspn(cmd, " \t");
+	if (*args)
+		*args++ = 0;
+	args += strspn(args, " \t");
+
+	err[0] = 0;
+	if (strcmp(cmd, "announce") == 0) {
+		ret = job_start(args, err, sizeof(err));
+	} else if (strcmp(cmd, "cancel") == 0 && *args) {
+		job_cancel(args);
+		ret = 0;
+	} else {
+		snprintf(err, sizeof(err), "unknown request");
+		ret = -1;
+	}
+
+	if (ret < 0) {
+		snprintf(reply, sizeof(reply), "error %s\n", err);
+		if (!quiet)
+			fprintf(stderr, "arping: %s: %s\n", cmd, err);
+	} else {
+		snprintf(reply, sizeof(reply), "ok\n");
+	}
+	/* short enough for any socket buffer */
+	if (write(c->w.fd, reply, strlen(reply)) < 0 && !quiet)
+		perror("arping: write");
+}
+
+void conn_input(struct arp_conn *c)
+{
+	int n;
+
+	n = read(c->w.fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n > 0) {
+		c->len += n;
+		if (!memchr(c->buf, '\n', c->len) && c->len < sizeof(c->buf) - 1)
+			return;
+		conn_request(c);
+	}
+	close(c->w.fd);
+	free(c);
+}
+
+void resident_cleanup(void)
+{
+	unlink(resident_path);
+}
+
+void resident_loop(void)
+{
+	struct arp_watch listen_w, signal_w, *w;
+	struct sockaddr_un sun;
+	struct epoll_event ev[16];
+	struct arp_conn *c;
+	sigset_t sset;
+	int i, n;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(resident_path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "arping: socket path too long: %s\n", resident_path);
+		exit(2);
+	}
+	strcpy(sun.sun_path, resident_path);
+
+	sigemptyset(&sset);
+	sigaddset(&sset, SIGINT);
+	sigaddset(&sset, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sset, NULL);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	signal_w.kind = WATCH_SIGNAL;
+	signal_w.fd = signalfd(-1, &sset, SFD_NONBLOCK|SFD_CLOEXEC);
+	listen_w.kind = WATCH_LISTEN;
+	listen_w.fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (epfd < 0 || signal_w.fd < 0 || listen_w.fd < 0) {
+		perror("arping: resident setup");
+		exit(2);
+	}
+
+	/* a stale socket of an earlier instance is in the way */
+	unlink(resident_path);
+	umask(077);
+	if (bind(listen_w.fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		fprintf(stderr, "arping: bind %s: %s\n", resident_path, strerror(errno));
+		exit(2);
+	}
+	atexit(resident_cleanup);
+	if (listen(listen_w.fd, 64) < 0 ||
+	    resident_watch_add(&listen_w) || resident_watch_add(&signal_w)) {
+		perror("arping: resident setup");
+		exit(2);
+	}
+	write_pidfile();
+
+	while (1) {
+		n = epoll_wait(epfd, ev, sizeof(ev)/sizeof(ev[0]), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("arping: epoll_wait");
+			exit(2);
+		}
+		for (i = 0; i < n; i++) {
+			w = ev[i].data.ptr;
+			if (w->fd < 0)
+				continue;
+			switch (w->kind) {
+			case WATCH_SIGNAL:
+				exit(0);
+			case WATCH_LISTEN:
+				c = calloc(1, sizeof(*c));
+				if (!c)
+					break;
+				c->w.kind = WATCH_CONN;
+				c->w.fd = accept4(listen_w.fd, NULL, NULL,
+						  SOCK_NONBLOCK|SOCK_CLOEXEC);
+				if (c->w.fd < 0 || resident_watch_add(&c->w)) {
+					if (c->w.fd >= 0)
+						close(c->w.fd);
+					free(c);
+				}
+				break;
+			case WATCH_CONN:
+				conn_input((struct arp_conn *)w);
+				break;
+			case WATCH_JOB:
+				job_tick((struct arp_job *)w);
+				break;
+			}
+		}
+		job_reap();
+	}
+}
+
+/*
+ * -C: have the announcer at path do it.  -1 if there is none to ask,
+ * otherwise the exit code.
+ */
+int resident_request(const char *path, const char *line)
+{
+	struct sockaddr_un sun;
+	struct timeval tv = { 5, 0 };
+	char reply[300];
+	int fd, len = 0, n;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+		close(fd);
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (write(fd, line, strlen(line)) != strlen(line)) {
+		perror("arping: write");
+		close(fd);
+		return 2;
+	}
+	while (len < sizeof(reply) - 1 &&
+	       (n = read(fd, reply + len, sizeof(reply) - 1 - len)) > 0)
+		len += n;
+	close(fd);
+	reply[len] = 0;
+	reply[strcspn(reply, "\n")] = 0;
+
+	if (strcmp(reply, "ok") == 0)
+		return 0;
+	fprintf(stderr, "arping: %s: %s\n", path,
+		strncmp(reply, "error ", 6) ? "no answer" : reply + 6);
+	return 2;
+}
+
+/* -p, as send_arp.libnet does it; IPaddr2 stops us through it */
+void write_pidfile(void)
+{
+	FILE *f;
+
+	if (!pidfile)
+		return;
+	f = fopen(pidfile, "w");
+	if (!f) {
+		fprintf(stderr, "arping: cannot write %s: %s\n",
+			pidfile, strerror(errno));
+		pidfile = NULL;
+		return;
+	}
+	fprintf(f, "%ld\n", (long)getpid());
+	fclose(f);
+	atexit(remove_pidfile);
+}
+
+void remove_pidfile(void)
+{
+	unlink(pidfile);
+}
 
-void usage(void)
+/* Comma separated device names */
+void add_devices(char *names)
 {
-	fprintf(stderr,
-		"Usage: arping [-fqbDUAV] [-c count] [-w timeout] [-I device] [-s source] destination\n"
-		"  -f : quit on first reply\n"
-		"  -q : be quiet\n"
-		"  -b : keep broadcasting, don't go unicast\n"
-		"  -D : duplicate address detection mode\n"
-		"  -U : Unsolicited ARP mode, update your neighbours\n"
-		"  -A : ARP answer mode, update your neighbours\n"
-		"  -V : print version and exit\n"
-		"  -c count : how many packets to send\n"
-		"  -w timeout : how long to wait for a reply\n"
-		"  -I device : which ethernet device to use (eth0)\n"
-		"  -s source : source ip address\n"
-		"  destination : ask for what ip address\n"
-		);
-	exit(2);
+	char *name, *save = NULL;
+	struct arp_if *ifp;
+
+	for (name = strtok_r(names, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		ifp = realloc(ifs, (nifs + 1) * sizeof(*ifs));
+		if (!ifp) {
+			perror("arping: realloc");
+			exit(2);
+		}
+		ifs = ifp;
+		memset(&ifs[nifs], 0, sizeof(*ifs));
+		ifs[nifs++].device = name;
+	}
 }
 
-void set_signal(int signo, void (*handler)(void))
+/* "auto", 00a0cc34a878 (as send_arp.libnet takes it) or 00:a0:cc:34:a8:78 */
+int parse_mac(const char *str, unsigned char *mac)
 {
-	struct sigaction sa;
+	int n = 0;
+	unsigned int byte;
 
-	memset(&sa, 0, sizeof(sa));
-	sa.sa_handler = (void (*)(int))handler;
-	sa.sa_flags = SA_RESTART;
-	sigaction(signo, &sa, NULL);
+	if (strcmp(str, "auto") == 0)
+		return 0;
+	while (*str && n < 8) {
+		if (!isxdigit(str[0]) || !isxdigit(str[1]) ||
+		    sscanf(str, "%2x", &byte) != 1)
+			return -1;
+		mac[n++] = byte;
+		str += 2;
+		if (*str == ':')
+			str++;
+	}
+	return *str ? -1 : n;
 }
 
-int send_pack(int s, struct in_addr src, struct in_addr dst,
-	      struct sockaddr_ll *ME, struct sockaddr_ll *HE)
+/* msecs, or secs with an s suffix; fractions are fine */
+int parse_ms(const char *str, long *ms)
 {
-	int err;
-	struct timeval now;
-	unsigned char buf[256];
-	struct arphdr *ah = (struct arphdr*)buf;
-	unsigned char *p = (unsigned char *)(ah+1);
+	char *end;
+	double v = strtod(str, &end);
+
+	if (end == str || v <= 0)
+		return -1;
+	if (strcmp(end, "s") == 0)
+		v *= 1000;
+	else if (*end && strcmp(end, "ms"))
+		return -1;
+	if (v < 1 || v > 86400000)
+		return -1;
+	*ms = v;
+	return 0;
+}
 
-	ah->ar_hrd = htons(ME->sll_hatype);
-	if (ah->ar_hrd == htons(ARPHRD_FDDI))
-		ah->ar_hrd = htons(ARPHRD_ETHER);
-	ah->ar_pro = htons(ETH_P_IP);
-	ah->ar_hln = ME->sll_halen;
-	ah->ar_pln = 4;
-	ah->ar_op  = advert ? htons(ARPOP_REPLY) : htons(ARPOP_REQUEST);
+/*
+ * count@interval[,backoff=factor][,max=interval][,total=time], e.g.
+ * 5@20,backoff=2,max=2s,total=30s: five packets 20 ms apart, then
+ * 40, 80, ... ms apart up to 2 s, as long as 30 s have not passed.
+ * Without total it ends once max is reached, without backoff after
+ * the burst.
+ */
+int parse_schedule(const char *spec, struct arp_schedule *sc,
+		   char *err, size_t errlen)
+{
+	char buf[256], *tok, *save = NULL, *end;
+	long burst, gap, maxi = 0, total = 0, elapsed = 0;
+	double backoff = 1;
+	int *ms;
+
+	if (strlen(spec) >= sizeof(buf)) {
+		snprintf(err, errlen, "schedule too long");
+		return -1;
+	}
+	strcpy(buf, spec);
 
-	memcpy(p, &ME->sll_addr, ah->ar_hln);
-	p+=ME->sll_halen;
+	tok = strtok_r(buf, ",", &save);
+	burst = tok ? strtol(tok, &end, 10) : 0;
+	if (!tok || burst <= 0 || *end != '@' || parse_ms(end + 1, &gap)) {
+		snprintf(err, errlen, "bad schedule %s, want count@interval first", spec);
+		return -1;
+	}
+	while ((tok = strtok_r(NULL, ",", &save))) {
+		if (strncmp(tok, "backoff=", 8) == 0)
+			backoff = strtod(tok + 8, &end);
+		else if (strncmp(tok, "max=", 4) == 0 && parse_ms(tok + 4, &maxi) == 0)
+			continue;
+		else if (strncmp(tok, "total=", 6) == 0 && parse_ms(tok + 6, &total) == 0)
+			continue;
+		else
+			end = tok;
+		if (*end || backoff < 1) {
+			snprintf(err, errlen, "bad schedule item %s", tok);
+			return -1;
+		}
+	}
+	if (backoff > 1 && !maxi && !total) {
+		snprintf(err, errlen, "schedule %s never ends, give max or total", spec);
+		return -1;
+	}
+	if (!maxi)
+		maxi = 86400000;
+	if (gap > maxi)
+		maxi = gap;
+
+	ms = malloc((SCHEDULE_MAX + 1) * sizeof(*ms));
+	if (!ms) {
+		snprintf(err, errlen, "%s", strerror(errno));
+		return -1;
+	}
+	/* the gap after each announcement; past the burst it grows */
+	for (sc->n = 0; sc->n < SCHEDULE_MAX; sc->n++) {
+		if (sc->n >= burst - 1) {
+			if (!total && (backoff <= 1 || gap >= maxi))
+				break;
+			gap = gap * backoff < maxi ? gap * backoff : maxi;
+			if (total && elapsed + gap > total)
+				break;
+		}
+		ms[sc->n] = gap;
+		elapsed += gap;
+	}
+	if (sc->n == SCHEDULE_MAX) {
+		free(ms);
+		snprintf(err, errlen, "schedule %s is too long", spec);
+		return -1;
+	}
+	ms[sc->n++] = gap;	/* the last one */
+	free(sc->ms);
+	sc->ms = realloc(ms, sc->n * sizeof(*ms));
+	if (!sc->ms)
+		sc->ms = ms;	/* the larger block will do */
+	return 0;
+}
 
-	memcpy(p, &src, 4);
-	p+=4;
+/*
+ * One shot for the tick after tick n.  With halves the ticks are
+ * pairs of request and reply, the reply halfway through.
+ */
+int schedule_arm(int fd, int n, int halves, struct arp_schedule *sc)
+{
+	struct itimerspec its;
+	int k = halves ? n / 2 : n;
+	long long ns = (long long)sc->ms[k < sc->n ? k : sc->n - 1] * 1000000;
+
+	if (halves)
+		ns = n % 2 ? ns - ns / 2 : ns / 2;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ns / 1000000000;
+	its.it_value.tv_nsec = ns % 1000000000;
+	return timerfd_settime(fd, 0, &its, NULL);
+}
 
-	if (advert)
-		memcpy(p, &ME->sll_addr, ah->ar_hln);
-	else
-		memcpy(p, &HE->sll_addr, ah->ar_hln);
-	p+=ah->ar_hln;
+/* Comma separated addresses, and optionally as many MAC addresses */
+void add_targets(char *ips, char *macs)
+{
+	char *ip, *mac, *ipsave = NULL, *macsave = NULL;
+	struct arp_target *t;
 
-	memcpy(p, &dst, 4);
-	p+=4;
+	for (ip = strtok_r(ips, ",", &ipsave); ip; ip = strtok_r(NULL, ",", &ipsave)) {
+		t = realloc(targets, (ntargets + 1) * sizeof(*targets));
+		if (!t) {
+			perror("arping: realloc");
+			exit(2);
+		}
+		targets = t;
+		t = &targets[ntargets++];
+		memset(t, 0, sizeof(*t));
+
+		if (inet_aton(ip, &t->ip) != 1) {
+			struct hostent *hp;
+			hp = gethostbyname2(ip, AF_INET);
+			if (!hp) {
+				fprintf(stderr, "arping: unknown host %s\n", ip);
+				exit(2);
+			}
+			memcpy(&t->ip, hp->h_addr, 4);
+		}
 
-	gettimeofday(&now, NULL);
-	err = sendto(s, buf, p-buf, 0, (struct sockaddr*)HE, sizeof(*HE));
-	if (err == p-buf) {
-		last = now;
-		sent++;
-		if (!unicasting)
-			brd_sent++;
+		if (!macs)
+			continue;
+		mac = strtok_r(macsave ? NULL : macs, ",", &macsave);
+		if (!mac) {
+			fprintf(stderr, "arping: no MAC address for %s\n", ip);
+			exit(2);
+		}
+		t->maclen = parse_mac(mac, t->mac);
+		if (t->maclen < 0) {
+			fprintf(stderr, "arping: invalid MAC address %s\n", mac);
+			exit(2);
+		}
 	}
-	return err;
 }
 
 void finish(void)
 {
+	int probing = !unsolicited && !dad;
+
 	if (!quiet) {
 		printf("Sent %d probes (%d broadcast(s))\n", sent, brd_sent);
 		printf("Received %d response(s)", received);
@@ -158,6 +1592,11 @@ void finish(void)
 		printf("\n");
 		fflush(stdout);
 	}
+	if (probing && (json || !quiet))
+		print_rtt();
+
+	if (scan)
+		exit(!!scan_report());
 
 	if (dad) {
 	    fflush(stdout);
@@ -171,24 +1610,428 @@ void finish(void)
 	exit(!received);
 }
 
+/*
+ * Operational state of our devices, from RTM_NEWLINK; returns -1 on
+ * errors.  Devices without operstate support say IF_OPER_UNKNOWN and
+ * have to do with IFF_RUNNING.
+ */
+int link_recv(int nl, int *done)
+{
+	char buf[16384];
+	struct nlmsghdr *nh;
+	struct ifinfomsg *ifi;
+	struct rtattr *rta;
+	int len, attrlen, i, oper;
+
+	len = recv(nl, buf, sizeof(buf), MSG_DONTWAIT);
+	if (len < 0)
+		return errno == EAGAIN || errno == EINTR ? 0 : -1;
+
+	for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+		if (nh->nlmsg_type == NLMSG_DONE || nh->nlmsg_type == NLMSG_ERROR) {
+			if (done)
+				*done = 1;
+			continue;
+		}
+		if (nh->nlmsg_type != RTM_NEWLINK && nh->nlmsg_type != RTM_DELLINK)
+			continue;
+		ifi = NLMSG_DATA(nh);
+		for (i = 0; i < nifs; i++)
+			if (ifs[i].ifindex == ifi->ifi_index)
+				break;
+		if (i == nifs)
+			continue;
+
+		oper = IF_OPER_UNKNOWN;
+		attrlen = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+		for (rta = IFLA_RTA(ifi); RTA_OK(rta, attrlen); rta = RTA_NEXT(rta, attrlen))
+			if (rta->rta_type == IFLA_OPERSTATE && RTA_PAYLOAD(rta) >= 1)
+				oper = *(unsigned char *)RTA_DATA(rta);
+		ifs[i].up = nh->nlmsg_type == RTM_NEWLINK && (ifi->ifi_flags & IFF_UP) &&
+			(oper == IF_OPER_UP ||
+			 (oper == IF_OPER_UNKNOWN && (ifi->ifi_flags & IFF_RUNNING)));
+		/* a flap within one read still restarts */
+		if (!done)
+			link_update();
+	}
+	return 0;
+}
+
+/* Subscribe to link changes, then get the state of now */
+int link_open(void)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct ifinfomsg ifi;
+	} req;
+	struct sockaddr_nl snl;
+	struct pollfd pfd;
+	int done = 0;
+
+	lfd = socket(AF_NETLINK, SOCK_RAW|SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (lfd < 0)
+		return -1;
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = RTMGRP_LINK;
+	if (bind(lfd, (struct sockaddr *)&snl, sizeof(snl)) < 0)
+		return -1;
+
+	memset(&req, 0, sizeof(req));
+	req.nh.nlmsg_len = sizeof(req);
+	req.nh.nlmsg_type = RTM_GETLINK;
+	req.nh.nlmsg_flags = NLM_F_REQUEST|NLM_F_DUMP;
+	req.ifi.ifi_family = AF_UNSPEC;
+	if (send(lfd, &req, sizeof(req), 0) < 0)
+		return -1;
+
+	pfd.fd = lfd;
+	pfd.events = POLLIN;
+	while (!done) {
+		if (poll(&pfd, 1, 1000) <= 0 || link_recv(lfd, &done) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* After each change of state: stop, or start over */
+void link_update(void)
+{
+	struct itimerspec its;
+	int i, down = -1;
+
+	for (i = 0; i < nifs; i++)
+		if (!ifs[i].up && down < 0)
+			down = i;
+
+	if (down >= 0 && !link_waiting) {
+		if (!quiet)
+			printf("Interface \"%s\" is down, waiting\n", ifs[down].device);
+		link_waiting = 1;
+		memset(&its, 0, sizeof(its));
+		timerfd_settime(tfd, 0, &its, NULL);
+
+		clock_gettime(CLOCK_MONOTONIC, &link_deadline);
+		link_deadline.tv_sec += (timeout ? timeout : LINK_WAIT) / 1000;
+		link_deadline.tv_nsec += ((timeout ? timeout : LINK_WAIT) % 1000) * 1000000L;
+		if (link_deadline.tv_nsec >= 1000000000L) {
+			link_deadline.tv_sec++;
+			link_deadline.tv_nsec -= 1000000000L;
+		}
+	} else if (down < 0 && link_waiting) {
+		link_waiting = 0;
+		if (!quiet) {
+			printf("Link up, %s\n", start.tv_sec ? "starting over" : "starting");
+			fflush(stdout);
+		}
+		announce_start();
+	}
+}
+
+int link_wait_left(void)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (link_deadline.tv_sec - now.tv_sec) * 1000 +
+		(link_deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+	return ms > 0 ? ms : 0;
+}
+
+/* Every interval msecs, or half of it with pairs */
+void timer_start(void)
+{
+	struct itimerspec its;
+	long period = interval * 1000000L;
+
+	/* with a schedule catcher() sets each tick */
+	if (schedule.n)
+		return;
+	memset(&its, 0, sizeof(its));
+	if (pairs)
+		period /= 2;
+	its.it_interval.tv_sec = period / 1000000000L;
+	its.it_interval.tv_nsec = period % 1000000000L;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(tfd, 0, &its, NULL)) {
+		perror("arping: timerfd_settime");
+		exit(2);
+	}
+}
+
+/* From the first packet on, again after a flap */
+void announce_start(void)
+{
+	tick = 0;
+	count = rounds;
+	timer_start();
+	catcher();
+}
+
+/*
+ * Called every interval msecs by the timer, or every half interval
+ * with pairs: requests go out on even ticks, replies on odd ones.
+ * With a schedule the timer is set anew for every tick.
+ */
 void catcher(void)
 {
 	struct timeval tv;
+	int n = tick++;
 
 	gettimeofday(&tv, NULL);
 
-	if (start.tv_sec==0)
+	if (start.tv_sec==0) {
 		start = tv;
+		if (!deadline.tv_sec)
+			set_deadline();
+	}
+	if (schedule.n && schedule_arm(tfd, n, pairs, &schedule)) {
+		perror("arping: timerfd_settime");
+		exit(2);
+	}
 
-	if (count-- == 0 || (timeout && MS_TDIFF(tv,start) > timeout*1000 + 500))
+	if (pairs && n % 2) {
+		send_frames(s, &replies);
+		if (count == 0)
+			finish();
+		return;
+	}
+
+	if (count-- == 0)
 		finish();
 
-	if (last.tv_sec==0 || MS_TDIFF(tv,last) > 500) {
+	if (unsolicited)
+		send_frames(s, advert ? &replies : &requests);
+	else if (scan)
+		send_frames(s, &requests);
+	else
 		send_pack(s, src, dst, &me, &he);
-		if (count == 0 && unsolicited)
+	if (count == 0 && unsolicited && !pairs)
+		finish();
+}
+
+/* The -w timeout starts now */
+void set_deadline(void)
+{
+	if (!timeout)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout / 1000;
+	deadline.tv_nsec += (timeout % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+}
+
+/* msecs until the -w timeout, -1 if there is none */
+int timeout_left(void)
+{
+	struct timespec now;
+	long ms;
+
+	if (!timeout)
+		return -1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline.tv_sec - now.tv_sec) * 1000 +
+		(deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+	return ms > 0 ? ms : 0;
+}
+
+int event_add(int fd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* The packet socket, the timer and SIGINT, ready for event_loop() */
+void event_setup(void)
+{
+	sigset_t sset;
+
+	sigemptyset(&sset);
+	sigaddset(&sset, SIGINT);
+	sigprocmask(SIG_BLOCK, &sset, NULL);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	sfd = signalfd(-1, &sset, SFD_NONBLOCK|SFD_CLOEXEC);
+	if (epfd < 0 || tfd < 0 || sfd < 0 ||
+	    event_add(s) || event_add(tfd) || event_add(sfd)) {
+		perror("arping: event setup");
+		exit(2);
+	}
+}
+
+/*
+ * Packets, timer ticks and SIGINT all arrive through one epoll set;
+ * the -w timeout is the epoll timeout.
+ */
+void event_loop(void)
+{
+	struct epoll_event ev[4];
+	int i, n, ms;
+
+	while (1) {
+		ms = timeout_left();
+		if (link_waiting && (ms < 0 || link_wait_left() < ms))
+			ms = link_wait_left();
+		n = epoll_wait(epfd, ev, sizeof(ev)/sizeof(ev[0]), ms);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("arping: epoll_wait");
+			exit(2);
+		}
+		if (link_waiting && link_wait_left() == 0) {
+			for (i = 0; i < nifs && !quiet; i++)
+				if (!ifs[i].up)
+					printf("Interface \"%s\" is still down\n", ifs[i].device);
+			exit(2);
+		}
+		if (n == 0)
+			finish();
+
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.fd == tfd) {
+				uint64_t ticks;
+
+				/* a late tick sends one packet, not a burst */
+				if (read(tfd, &ticks, sizeof(ticks)) == sizeof(ticks))
+					catcher();
+			} else if (ev[i].data.fd == sfd) {
+				finish();
+			} else if (ev[i].data.fd == lfd) {
+				if (link_recv(lfd, NULL) < 0)
+					perror("arping: netlink recv");
+			} else if (ev[i].data.fd == s) {
+				unsigned char packet[4096];
+				struct sockaddr_ll from;
+				socklen_t alen = sizeof(from);
+				int cc;
+
+				while ((cc = recvfrom(s, packet, sizeof(packet), MSG_DONTWAIT,
+						      (struct sockaddr *)&from, &alen)) >= 0) {
+					if (scan)
+						recv_scan(packet, cc, &from);
+					else
+						recv_pack(packet, cc, &from);
+					alen = sizeof(from);
+				}
+				if (errno != EAGAIN && errno != EINTR)
+					perror("arping: recvfrom");
+			}
+		}
+		if (timeout && timeout_left() == 0)
 			finish();
 	}
-	alarm(1);
+}
+
+void rtt_add(long usecs)
+{
+	int shift;
+
+	if (usecs < 0)
+		usecs = 0;
+	if (usecs > 0x7fffffffL)
+		usecs = 0x7fffffffL;
+	if (!rtt_n || usecs < rtt_min)
+		rtt_min = usecs;
+	if (usecs > rtt_max)
+		rtt_max = usecs;
+	rtt_sum += usecs;
+	rtt_n++;
+
+	if (usecs < RTT_SUB) {
+		rtt_hist[usecs]++;
+		return;
+	}
+	/* RTT_SUB is 1 << 4 */
+	shift = 31 - __builtin_clz(usecs) - 4;
+	rtt_hist[(shift + 1) * RTT_SUB + (usecs >> shift) - RTT_SUB]++;
+}
+
+/* The largest value that goes into bucket i */
+long rtt_bucket_max(int i)
+{
+	int shift = i / RTT_SUB - 1;
+
+	if (i < RTT_SUB)
+		return i;
+	return ((long)(RTT_SUB + i % RTT_SUB + 1) << shift) - 1;
+}
+
+/* Bounded by the exact minimum and maximum */
+long rtt_percentile(int pct)
+{
+	long rank = ((long)rtt_n * pct + 99) / 100, seen = 0, v;
+	int i;
+
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < sizeof(rtt_hist)/sizeof(rtt_hist[0]) - 1; i++) {
+		seen += rtt_hist[i];
+		if (seen >= rank)
+			break;
+	}
+	v = rtt_bucket_max(i);
+	if (v < rtt_min)
+		v = rtt_min;
+	if (v > rtt_max)
+		v = rtt_max;
+	return v;
+}
+
+/* After the Sent/Received lines, or all of it as JSON with -j */
+void print_rtt(void)
+{
+	double loss = sent ? 100.0 * (sent - received) / sent : 0;
+	const char *sep = "";
+	int i;
+
+	if (loss < 0)
+		loss = 0;
+	if (!json) {
+		printf("%.1f%% loss", loss);
+		if (rtt_n)
+			printf(", rtt min/avg/p50/p99/max = %.3f/%.3f/%.3f/%.3f/%.3f ms",
+			       rtt_min / 1000.0, rtt_sum / 1000.0 / rtt_n,
+			       rtt_percentile(50) / 1000.0, rtt_percentile(99) / 1000.0,
+			       rtt_max / 1000.0);
+		printf("\n");
+		fflush(stdout);
+		return;
+	}
+
+	printf("{\"destination\": \"%s\", ", inet_ntoa(dst));
+	printf("\"source\": \"%s\", \"device\": \"%s\", ",
+	       inet_ntoa(src), device ? device : "");
+	printf("\"sent\": %d, \"broadcasts\": %d, \"received\": %d, "
+	       "\"broadcast_replies\": %d, \"requests\": %d, \"loss_pct\": %.1f",
+	       sent, brd_sent, received, brd_recv, req_recv, loss);
+	if (rtt_n) {
+		printf(", \"rtt_ms\": {\"min\": %.3f, \"avg\": %.3f, \"p50\": %.3f, "
+		       "\"p99\": %.3f, \"max\": %.3f}",
+		       rtt_min / 1000.0, rtt_sum / 1000.0 / rtt_n,
+		       rtt_percentile(50) / 1000.0, rtt_percentile(99) / 1000.0,
+		       rtt_max / 1000.0);
+		/* [upper bound in ms, count] of every bucket used */
+		printf(", \"histogram\": [");
+		for (i = 0; i < sizeof(rtt_hist)/sizeof(rtt_hist[0]); i++) {
+			if (!rtt_hist[i])
+				continue;
+			printf("%s[%.3f, %u]", sep, rtt_bucket_max(i) / 1000.0, rtt_hist[i]);
+			sep = ", ";
+		}
+		printf("]");
+	}
+	printf("}\n");
+	fflush(stdout);
 }
 
 void print_hex(unsigned char *p, int len)
@@ -286,9 +2129,7 @@ int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM)
 		if (last.tv_sec) {
 			long usecs = (tv.tv_sec-last.tv_sec) * 1000000 +
 				tv.tv_usec-last.tv_usec;
-			long msecs = (usecs+500)/1000;
-			usecs -= msecs*1000 - 500;
-			printf(" %ld.%03ldms\n", msecs, usecs);
+			printf(" %ld.%03ldms\n", usecs/1000, usecs%1000);
 		} else {
 			printf(" UNSOLICITED?\n");
 		}
@@ -299,6 +2140,8 @@ int recv_pack(unsigned char *buf, int len, struct sockaddr_ll *FROM)
 		brd_recv++;
 	if (ah->ar_op == htons(ARPOP_REQUEST))
 		req_recv++;
+	if (last.tv_sec && !dad)
+		rtt_add((tv.tv_sec-last.tv_sec) * 1000000 + tv.tv_usec-last.tv_usec);
 	if (quit_on_reply)
 		finish();
 	if(!broadcast_only) {
@@ -324,12 +2167,13 @@ main(int argc, char **argv)
 	int ch;
 	uid_t uid = getuid();
 	int hb_mode = 0;
+	int i, k;
+	socklen_t alen;
+	char *sched_spec = NULL, errbuf[256];
 
 	signal(SIGTERM, byebye);
 	signal(SIGPIPE, byebye);
 	
-	device = strdup("eth0");
-	
 	s = socket(PF_PACKET, SOCK_DGRAM, 0);
 	socket_errno = errno;
 
@@ -338,7 +2182,7 @@ main(int argc, char **argv)
 		exit(-1);
 	}
 
-	while ((ch = getopt(argc, argv, "h?bfDUAqc:w:s:I:Vr:i:p:")) != EOF) {
+	while ((ch = getopt(argc, argv, "h?bfDUANqjc:w:s:S:I:F:Vr:i:p:R:C:X:")) != EOF) {
 		switch(ch) {
 		case 'b':
 			broadcast_only=1;
@@ -347,6 +2191,12 @@ main(int argc, char **argv)
 			dad++;
 			quit_on_reply=1;
 			break;
+		case 'N':
+			warmup = 1;
+			break;
+		case 'F':
+			peerfile = optarg;
+			break;
 		case 'U':
 			unsolicited++;
 			break;
@@ -357,6 +2207,9 @@ main(int argc, char **argv)
 		case 'q':
 			quiet++;
 			break;
+		case 'j':
+			json = 1;
+			break;
 		case 'r': /* send_arp.libnet compatibility option */
 			hb_mode = 1;
 			/* fall-through */
@@ -364,10 +2217,10 @@ main(int argc, char **argv)
 			count = atoi(optarg);
 			break;
 		case 'w':
-			timeout = atoi(optarg);
+			timeout = strtod(optarg, NULL) * 1000;
 			break;
 		case 'I':
-			device = optarg;
+			add_devices(optarg);
 			break;
 		case 'f':
 			quit_on_reply=1;
@@ -375,13 +2228,36 @@ main(int argc, char **argv)
 		case 's':
 			source = optarg;
 			break;
+		case 'S':
+			sched_spec = optarg;
+			if (parse_schedule(optarg, &schedule, errbuf, sizeof(errbuf))) {
+				fprintf(stderr, "arping: %s\n", errbuf);
+				exit(2);
+			}
+			break;
 		case 'V':
 			printf("send_arp utility\n");
 			exit(0);
-		case 'p':
 		case 'i':
+			interval = atoi(optarg);
+			if (interval <= 0) {
+				fprintf(stderr, "arping: bad interval %s\n", optarg);
+				exit(2);
+			}
+			break;
+		case 'R':
+			resident_path = optarg;
+			break;
+		case 'C':
+			announcer = optarg;
+			break;
+		case 'X':
+			cancel_ips = optarg;
+			break;
+		case 'p':
 		    hb_mode = 1;
-		    /* send_arp.libnet compatibility options, ignore */
+		    /* send_arp.libnet compatibility option */
+		    pidfile = optarg;
 		    break;
 		case 'h':
 		case '?':
@@ -390,36 +2266,103 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (resident_path) {
+		if (s >= 0)
+			close(s);
+		resident_loop();
+	}
+	if (cancel_ips) {
+		char line[4096];
+
+		if (!announcer)
+			usage();
+		snprintf(line, sizeof(line), "cancel %s\n", cancel_ips);
+		/* nothing runs if nobody is there */
+		exit(resident_request(announcer, line) == 2 ? 2 : 0);
+	}
+
 	if(hb_mode) {
 	    /* send_arp.libnet compatibility mode */
 	    if (argc - optind != 5) {
 		usage();
 		return 1;
 	    }
+	    if (announcer) {
+		char line[4096];
+		int ret;
+
+		if (sched_spec)
+			ret = snprintf(line, sizeof(line), "announce %s %d %s %s %s\n",
+				       sched_spec, count, argv[optind],
+				       argv[optind+1], argv[optind+2]);
+		else
+			ret = snprintf(line, sizeof(line), "announce %d %d %s %s %s\n",
+				       interval, count, argv[optind],
+				       argv[optind+1], argv[optind+2]);
+		/* refused, a device that is down say, or nobody there: do it ourselves */
+		if (ret < sizeof(line) &&
+		    resident_request(announcer, line) == 0)
+			exit(0);
+	    }
 	    /*
 	     *	argv[optind+1] DEVICE		dc0,eth0:0,hme0:0,
-	     *	argv[optind+2] IP		192.168.195.186
-	     *	argv[optind+3] MAC ADDR		00a0cc34a878
+	     *	argv[optind+2] IP		192.168.195.186[,...]
+	     *	argv[optind+3] MAC ADDR		auto|00a0cc34a878[,...]
 	     *	argv[optind+4] BROADCAST	192.168.195.186
 	     *	argv[optind+5] NETMASK		ffffffffffff
 	     */
 
 	    unsolicited = 1;
-	    device = argv[optind];
-	    target = argv[optind+1];
+	    pairs = 1;
+	    nifs = 0;
+	    add_devices(argv[optind]);
+	    add_targets(argv[optind+1],
+			strcmp(argv[optind+2], "auto") ? argv[optind+2] : NULL);
 
 	} else {
 	    argc -= optind;
 	    argv += optind;
-	    if (argc != 1)
+	    if (argc < 1 && !(warmup && peerfile))
 		usage();
 
-	    target = *argv;
+	    while (argc-- > 0)
+		add_targets(*argv++, NULL);
+	    if (warmup && peerfile)
+		read_peers(peerfile);
 	}
-	
-	if (device == NULL) {
-		fprintf(stderr, "arping: device (option -I) is required\n");
+	if (warmup) {
+		/* the hash tells the notifications of our peers */
+		if (ntargets == 0) {
+			fprintf(stderr, "arping: no peers to resolve\n");
+			exit(2);
+		}
+		scan_init();
+	} else if (ntargets != 1 && !unsolicited && !dad) {
+		fprintf(stderr, "arping: only -U, -A and -D take more than one destination\n");
+		exit(2);
+	}
+	if (ntargets > 1 && dad) {
+		/* all the answers are waited for */
+		scan = 1;
+		quit_on_reply = 0;
+		scan_init();
+	}
+	if (ntargets == 0)
 		usage();
+	dst = targets[0].ip;
+	/* stdout is for the JSON alone, not a line per reply */
+	if (json && !unsolicited && !dad)
+		quiet = 1;
+
+	/* -c or -r still cut the schedule short */
+	if (schedule.n && (count < 0 || count > schedule.n))
+		count = schedule.n;
+
+	if (nifs == 0)
+		add_devices(strdup("eth0"));
+	if (nifs > 1 && !unsolicited) {
+		fprintf(stderr, "arping: only -U and -A take more than one device\n");
+		exit(2);
 	}
 
 	if (s < 0) {
@@ -428,21 +2371,24 @@ main(int argc, char **argv)
 		exit(2);
 	}
 
-	if (1) {
+	for (i = 0; i < nifs; i++) {
 		struct ifreq ifr;
+
+		device = ifs[i].device;
 		memset(&ifr, 0, sizeof(ifr));
 		strncpy(ifr.ifr_name, device, IFNAMSIZ-1);
 		if (ioctl(s, SIOCGIFINDEX, &ifr) < 0) {
 			fprintf(stderr, "arping: unknown iface %s\n", device);
 			exit(2);
 		}
-		ifindex = ifr.ifr_ifindex;
+		ifs[i].ifindex = ifr.ifr_ifindex;
 
 		if (ioctl(s, SIOCGIFFLAGS, (char*)&ifr)) {
 			perror("ioctl(SIOCGIFFLAGS)");
 			exit(2);
 		}
-		if (!(ifr.ifr_flags&IFF_UP)) {
+		/* announcements wait for the link instead */
+		if (!(ifr.ifr_flags&IFF_UP) && !unsolicited) {
 			if (!quiet)
 				printf("Interface \"%s\" is down\n", device);
 			exit(2);
@@ -453,16 +2399,11 @@ main(int argc, char **argv)
 			exit(dad?0:2);
 		}
 	}
+	device = ifs[0].device;
+	ifindex = ifs[0].ifindex;
 
-	if (inet_aton(target, &dst) != 1) {
-		struct hostent *hp;
-		hp = gethostbyname2(target, AF_INET);
-		if (!hp) {
-			fprintf(stderr, "arping: unknown host %s\n", target);
-			exit(2);
-		}
-		memcpy(&dst, hp->h_addr, 4);
-	}
+	if (warmup)
+		exit(warm_neighbours());
 
 	if (source && inet_aton(source, &src) != 1) {
 		fprintf(stderr, "arping: invalid source %s\n", source);
@@ -514,33 +2455,85 @@ main(int argc, char **argv)
 		close(probe_fd);
 	};
 
-	me.sll_family = AF_PACKET;
-	me.sll_ifindex = ifindex;
-	me.sll_protocol = htons(ETH_P_ARP);
-	if (bind(s, (struct sockaddr*)&me, sizeof(me)) == -1) {
-		perror("bind");
-		exit(2);
+	/* like the first one, the other announced addresses must be ours */
+	for (i = 1; i < ntargets && unsolicited && !source; i++) {
+		struct sockaddr_in saddr;
+		int probe_fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+		memset(&saddr, 0, sizeof(saddr));
+		saddr.sin_family = AF_INET;
+		saddr.sin_addr = targets[i].ip;
+		if (probe_fd < 0 ||
+		    bind(probe_fd, (struct sockaddr*)&saddr, sizeof(saddr)) == -1) {
+			fprintf(stderr, "arping: %s: %s\n",
+				inet_ntoa(targets[i].ip), strerror(errno));
+			exit(2);
+		}
+		close(probe_fd);
 	}
 
-	if (1) {
-		socklen_t alen = sizeof(me);
+	/*
+	 * Binding to each device in turn tells its link layer address;
+	 * going backwards leaves the socket on the first one.
+	 */
+	for (k = nifs - 1; k >= 0; k--) {
+		device = ifs[k].device;
+		memset(&me, 0, sizeof(me));
+		me.sll_family = AF_PACKET;
+		me.sll_ifindex = ifs[k].ifindex;
+		me.sll_protocol = htons(ETH_P_ARP);
+		if (bind(s, (struct sockaddr*)&me, sizeof(me)) == -1) {
+			perror("bind");
+			exit(2);
+		}
+
+		alen = sizeof(me);
 		if (getsockname(s, (struct sockaddr*)&me, &alen) == -1) {
 			perror("getsockname");
 			exit(2);
 		}
-	}
-	if (me.sll_halen == 0) {
-		if (!quiet)
-			printf("Interface \"%s\" is not ARPable (no ll address)\n", device);
-		exit(dad?0:2);
+		if (me.sll_halen == 0) {
+			if (!quiet)
+				printf("Interface \"%s\" is not ARPable (no ll address)\n", device);
+			exit(dad?0:2);
+		}
+		for (i = 0; i < ntargets; i++) {
+			if (targets[i].maclen && targets[i].maclen != me.sll_halen) {
+				fprintf(stderr, "arping: MAC address of %s does not fit %s\n",
+					inet_ntoa(targets[i].ip), device);
+				exit(2);
+			}
+		}
+
+		he = me;
+		memset(he.sll_addr, -1, he.sll_halen);
+		ifs[k].me = me;
+		ifs[k].he = he;
 	}
 
-	he = me;
-	memset(he.sll_addr, -1, he.sll_halen);
+	attach_filter(s);
+
+	/* several devices: send on each, hear them all */
+	if (nifs > 1) {
+		struct sockaddr_ll any;
+
+		memset(&any, 0, sizeof(any));
+		any.sll_family = AF_PACKET;
+		any.sll_protocol = htons(ETH_P_ARP);
+		if (bind(s, (struct sockaddr*)&any, sizeof(any)) == -1) {
+			perror("bind");
+			exit(2);
+		}
+	}
 
 	if (!quiet) {
 		printf("ARPING %s ", inet_ntoa(dst));
-		printf("from %s %s\n",  inet_ntoa(src), device ? : "");
+		if (ntargets > 1)
+			printf("and %d more ", ntargets - 1);
+		printf("from %s %s",  inet_ntoa(src), device ? device : "");
+		for (k = 1; k < nifs; k++)
+			printf(",%s", ifs[k].device);
+		printf("\n");
 	}
 
 	if (!src.s_addr && !dad) {
@@ -548,30 +2541,36 @@ main(int argc, char **argv)
 		exit(2);
 	}
 
-	set_signal(SIGINT, finish);
-	set_signal(SIGALRM, catcher);
-
-	catcher();
+	if (scan)
+		build_frames(&requests, ARPOP_REQUEST, ifs, nifs, targets, ntargets);
+	if (unsolicited) {
+		if (!advert)
+			build_frames(&requests, ARPOP_REQUEST, ifs, nifs, targets, ntargets);
+		if (advert || pairs)
+			build_frames(&replies, ARPOP_REPLY, ifs, nifs, targets, ntargets);
+	}
+	write_pidfile();
 
-	while(1) {
-		sigset_t sset, osset;
-		unsigned char packet[4096];
-		struct sockaddr_ll from;
-		socklen_t alen = sizeof(from);
-		int cc;
+	event_setup();
 
-		if ((cc = recvfrom(s, packet, sizeof(packet), 0,
-				   (struct sockaddr *)&from, &alen)) < 0) {
-			perror("arping: recvfrom");
-			continue;
+	rounds = count;
+	if (unsolicited) {
+		if (link_open() < 0 || event_add(lfd)) {
+			perror("arping: RTM_GETLINK");
+			exit(2);
 		}
-		sigemptyset(&sset);
-		sigaddset(&sset, SIGALRM);
-		sigaddset(&sset, SIGINT);
-		sigprocmask(SIG_BLOCK, &sset, &osset);
-		recv_pack(packet, cc, &from);
-		sigprocmask(SIG_SETMASK, &osset, NULL);
+		/* -w covers the wait as well */
+		set_deadline();
+		for (i = 0; i < nifs && ifs[i].up; i++)
+			;
+		if (i == nifs)
+			announce_start();
+		else
+			link_update();
+	} else {
+		announce_start();
 	}
+	event_loop();
 }
 
 
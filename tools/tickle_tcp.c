@@ -20,20 +20,34 @@
 */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 #include <netinet/ip.h>
 #include <netinet/ip6.h>
 #include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/timerfd.h>
 #include <arpa/inet.h>
 #include <net/if.h>
-
-#define discard_const(ptr) ((void *)((intptr_t)(ptr)))
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/inet_diag.h>
 
 typedef union {
 	struct sockaddr     sa;
@@ -41,74 +55,307 @@ typedef union {
 	struct sockaddr_in6 ip6;
 } sock_addr;
 
-uint32_t uint16_checksum(uint16_t *data, size_t n);
+/*
+ * A fully built tickle packet.  The pseudo header and TCP header are
+ * summed once when the packet is built; changing the sequence numbers
+ * or the flags afterwards only patches the checksum (RFC 1624).
+ */
+struct tickle_pkt {
+	union {
+		struct {
+			struct iphdr ip;
+			struct tcphdr tcp;
+		} ip4;
+		struct {
+			struct ip6_hdr ip6;
+			struct tcphdr tcp;
+		} ip6;
+	} u;
+	struct tcphdr *tcp;
+	size_t len;
+	int family;
+};
+
+/*
+ * Sends tickle packets over one raw socket per address family and
+ * paces them: a token bucket caps the packet rate, and rounds can be
+ * spread out in time.  All waiting is done on a timerfd.  The token
+ * bucket is kept as a time credit: every packet costs interval_ns,
+ * credit accrues with time up to burst_ns.
+ */
+struct tickle_sender {
+	int s4;
+	int s6;
+	int tfd;
+	uint64_t interval_ns;	/* 0: no rate limit */
+	uint64_t burst_ns;
+	uint64_t credit_ns;
+	uint64_t last_ns;
+};
+
+/* What a run did, for the -S summary */
+#define STATS_MAX_ERRNO	16
+
+struct tickle_stats {
+	uint64_t tuples;	/* unique connections */
+	uint64_t duplicates;
+	uint64_t bad_lines;
+	uint64_t bad_inputs;	/* state files that could not be read */
+	uint64_t sent;
+	uint64_t send_errors;
+	uint64_t killed;
+	struct {
+		int err;
+		uint64_t count;
+	} errnos[STATS_MAX_ERRNO];
+	uint64_t start_ns;
+	uint64_t send_start_ns;
+	uint64_t end_ns;
+};
+
+static struct tickle_stats stats;
+
+/* Called for every connection found by a tuple source */
+typedef int tuple_fn(const sock_addr *src, const sock_addr *dst, void *priv);
+
+/*
+ * Binary state file: a header followed by count fixed size records,
+ * sorted, all in network byte order.  The record size depends on the
+ * address family, a file holds connections of one family only.  The
+ * file is mmap()ed and walked as is, nothing is parsed.
+ */
+#define STATE_MAGIC	"TKLS"
+#define STATE_VERSION	1
+
+struct state_hdr {
+	char     magic[4];
+	uint8_t  version;
+	uint8_t  family;	/* 4 or 6 */
+	uint16_t generation;	/* of the journal that goes with it, 0 for none */
+	uint32_t count;
+	uint32_t csum;		/* FNV-1a over the records */
+};
+
+struct state_rec4 {
+	uint32_t src;
+	uint32_t dst;
+	uint16_t sport;
+	uint16_t dport;
+};
+
+struct state_rec6 {
+	uint8_t  src[16];
+	uint8_t  dst[16];
+	uint16_t sport;
+	uint16_t dport;
+};
+
+/* Records of one address family, collected in memory */
+struct tuple_vec {
+	int family;
+	size_t recsize;
+	size_t count;
+	size_t alloc;
+	uint8_t *recs;
+};
+
+/* A connection as stored in a tuple_set slot; family 0 is a free slot */
+struct tuple_key {
+	uint8_t family;		/* 4 or 6 */
+	uint8_t reserved[3];
+	union {
+		struct state_rec4 r4;
+		struct state_rec6 r6;
+	} rec;
+};
+
+/* Open addressing (linear probing) hash set of connections */
+struct tuple_set {
+	struct tuple_key *slots;
+	size_t size;		/* power of two */
+	size_t count;
+};
+
+/*
+ * The recorder appends the changes to a state file to
+ * "<state file>.journal": a journal_hdr, then per change an entry
+ * header followed by a state_rec4 or state_rec6.  Replaying the
+ * journal in order over the state file yields the current
+ * connections, but only over the state file it was started for: a
+ * "+" replayed over a later state brings back a connection that has
+ * closed since.  Both carry a generation, which the recorder bumps
+ * each time it writes a new state file; a text state file has it on
+ * a "# generation N" first line.
+ */
+#define JOURNAL_MAGIC	"TKLJ"
+
+struct journal_hdr {
+	char     magic[4];
+	uint16_t generation;	/* never 0 */
+	uint16_t reserved;
+};
+
+struct journal_ent {
+	uint8_t op;		/* '+' or '-' */
+	uint8_t family;		/* 4 or 6 */
+	uint16_t reserved;
+};
+
+/* A state file being (re)written; it replaces the old one on close */
+struct state_writer {
+	FILE *f;
+	char *path;
+	char *tmppath;
+};
+
+uint32_t csum_partial(const void *buf, size_t n, uint32_t sum);
 void set_nonblocking(int fd);
 void set_close_on_exec(int fd);
 static int parse_ipv4(const char *s, unsigned port, struct sockaddr_in *sin);
 static int parse_ipv6(const char *s, const char *iface, unsigned port, sock_addr *saddr);
 int parse_ip(const char *addr, const char *iface, unsigned port, sock_addr *saddr);
 int parse_ip_port(const char *addr, sock_addr *saddr);
-int send_tickle_ack(const sock_addr *dst, 
-		    const sock_addr *src, 
-		    uint32_t seq, uint32_t ack, int rst);
+int parse_ip_port_n(const char *s, size_t len, sock_addr *saddr);
+int build_tickle_pkt(struct tickle_pkt *pkt, const sock_addr *dst,
+		     const sock_addr *src,
+		     uint32_t seq, uint32_t ack, int rst);
+void tickle_pkt_set_seq(struct tickle_pkt *pkt, uint32_t seq, uint32_t ack);
+void tickle_pkt_set_rst(struct tickle_pkt *pkt, int rst);
+int sender_init(struct tickle_sender *snd, unsigned pps);
+void sender_close(struct tickle_sender *snd);
+int sender_sleep_until(struct tickle_sender *snd, uint64_t when_ns);
+int sender_pace(struct tickle_sender *snd);
+int send_tickle_pkt(struct tickle_sender *snd, const struct tickle_pkt *pkt,
+		    const sock_addr *dst);
+int format_ip_port(const sock_addr *saddr, char *buf, size_t len);
+int diag_dump(const sock_addr *local, tuple_fn *fn, void *priv);
+int state_writer_open(struct state_writer *w, const char *path);
+int state_writer_close(struct state_writer *w);
+void state_writer_abort(struct state_writer *w);
+uint32_t hash32(const void *buf, size_t n, uint32_t h);
+void tuple_to_rec(const sock_addr *src, const sock_addr *dst, void *rec);
+void rec_to_tuple(int family, const void *rec, sock_addr *src, sock_addr *dst);
+int tuple_vec_add(const sock_addr *src, const sock_addr *dst, void *priv);
+void tuple_vec_free(struct tuple_vec *v);
+int write_binary_state(struct state_writer *w, struct tuple_vec *v,
+		       unsigned gen);
+int parse_text_state(const char *buf, size_t len, tuple_fn *fn, void *priv);
+int read_text_stream(int fd, tuple_fn *fn, void *priv);
+int read_state_file(const char *path, tuple_fn *fn, void *priv,
+		    unsigned *gen);
+int tuple_set_init(struct tuple_set *set, size_t hint);
+void tuple_set_free(struct tuple_set *set);
+int tuple_set_add(struct tuple_set *set, const struct tuple_key *key);
+int tuple_set_del(struct tuple_set *set, const struct tuple_key *key);
+int tuple_set_insert(const sock_addr *src, const sock_addr *dst, void *priv);
+int tuple_set_walk(struct tuple_set *set, tuple_fn *fn, void *priv);
+int replay_journal(const char *path, struct tuple_set *set, unsigned gen);
+int read_state(const char *path, tuple_fn *fn, void *priv);
+int read_state_dir(const char *path, tuple_fn *fn, void *priv);
+int read_vip_states(const char *dir, char **vips, int nvips,
+		    tuple_fn *fn, void *priv);
+int write_state(const char *path, struct tuple_set *set, int binary,
+		unsigned gen);
+int record_connections(const sock_addr *local, const char *path,
+		       int interval, int binary);
+int kill_connections(struct tickle_sender *snd, struct tuple_set *set,
+		     int rounds);
+static int write_tuple(const sock_addr *src, const sock_addr *dst, void *priv);
+int tickle_rounds(struct tickle_sender *snd, struct tuple_set *set,
+		  int rounds, unsigned spacing_ms);
+static void stats_send_error(int err);
+static int collect_tuple(const sock_addr *src, const sock_addr *dst, void *priv);
+int print_stats(const char *path, int json);
 static void usage(void);
 
-uint32_t uint16_checksum(uint16_t *data, size_t n)
+/*
+ * One's complement sum of a buffer, in network byte order.  Words are
+ * added 32 bits at a time into a 64 bit accumulator and folded once at
+ * the end; the result may be fed back in as sum for the next chunk.
+ */
+uint32_t csum_partial(const void *buf, size_t n, uint32_t sum)
 {
-	uint32_t sum=0;
-	while (n >= 2) {
-		sum += (uint32_t)ntohs(*data);
-		data++;        
+	const uint8_t *p = buf;
+	uint64_t acc = sum;
+	uint32_t w;
+	uint16_t h;
+
+	while (n >= 4) {
+		memcpy(&w, p, 4);
+		acc += w;
+		p += 4;
+		n -= 4;
+	}
+	if (n >= 2) {
+		memcpy(&h, p, 2);
+		acc += h;
+		p += 2;
 		n -= 2;
-	}                      
+	}
 	if (n == 1) {
-		sum += (uint32_t)ntohs(*(uint8_t *)data);
+		h = 0;
+		memcpy(&h, p, 1);
+		acc += h;
 	}
-	return sum;
-}       
+	acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+	acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+	return (uint32_t)acc;
+}
 
-static uint16_t tcp_checksum(uint16_t *data, size_t n, struct iphdr *ip)
+static uint16_t csum_fold(uint32_t sum)
 {
-	uint32_t sum = uint16_checksum(data, n);
-	uint16_t sum2;
-	sum += uint16_checksum((uint16_t *)(void *)&ip->saddr,
-				sizeof(ip->saddr));
-	sum += uint16_checksum((uint16_t *)(void *)&ip->daddr,
-				sizeof(ip->daddr));
-	sum += ip->protocol + n;
 	sum = (sum & 0xFFFF) + (sum >> 16);
 	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum2 = htons(sum);
-	sum2 = ~sum2;
+	return (uint16_t)sum;
+}
+
+static uint16_t csum_finish(uint32_t sum)
+{
+	uint16_t sum2 = ~csum_fold(sum);
+
 	if (sum2 == 0) {
 		return 0xFFFF;
 	}
 	return sum2;
 }
 
-static uint16_t tcp_checksum6(uint16_t *data, size_t n, struct ip6_hdr *ip6)
+/* RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m') */
+static uint16_t csum_replace16(uint16_t check, uint16_t old, uint16_t new)
 {
-	uint32_t phdr[2];
-	uint32_t sum = 0;
-	uint16_t sum2;
+	uint32_t sum;
+
+	sum = (uint16_t)~check;
+	sum += (uint16_t)~old;
+	sum += new;
+	return ~csum_fold(sum);
+}
+
+static uint16_t csum_replace32(uint16_t check, uint32_t old, uint32_t new)
+{
+	check = csum_replace16(check, old >> 16, new >> 16);
+	return csum_replace16(check, old & 0xFFFF, new & 0xFFFF);
+}
+
+static uint32_t tcp_pseudo_sum(struct iphdr *ip, size_t n)
+{
+	uint32_t sum;
+
+	sum = csum_partial(&ip->saddr, sizeof(ip->saddr), 0);
+	sum = csum_partial(&ip->daddr, sizeof(ip->daddr), sum);
+	return sum + htons(ip->protocol) + htons(n);
+}
 
-	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_src, 16);
-	sum += uint16_checksum((uint16_t *)(void *)&ip6->ip6_dst, 16);
+static uint32_t tcp_pseudo_sum6(struct ip6_hdr *ip6, size_t n)
+{
+	uint32_t phdr[2];
+	uint32_t sum;
 
 	phdr[0] = htonl(n);
 	phdr[1] = htonl(ip6->ip6_nxt);
-	sum += uint16_checksum((uint16_t *)phdr, 8);
-
-	sum += uint16_checksum(data, n);
 
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum = (sum & 0xFFFF) + (sum >> 16);
-	sum2 = htons(sum);
-	sum2 = ~sum2;
-	if (sum2 == 0) {
-		return 0xFFFF;
-	}
-	return sum2;
+	sum = csum_partial(&ip6->ip6_src, 16, 0);
+	sum = csum_partial(&ip6->ip6_dst, 16, sum);
+	return csum_partial(phdr, sizeof(phdr), sum);
 }
 
 void set_nonblocking(int fd)
@@ -173,207 +420,2134 @@ int parse_ip(const char *addr, const char *iface, unsigned port, sock_addr *sadd
 
 int parse_ip_port(const char *addr, sock_addr *saddr)
 {
-	char *s, *p;
-	unsigned port;
-	char *endp = NULL;
-	int ret;
+	if (parse_ip_port_n(addr, strlen(addr), saddr)) {
+		fprintf(stderr, "Failed to translate %s into an ip:port\n", addr);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Dotted quad of exactly len characters; like inet_pton(), octets
+ * with leading zeros are refused.
+ */
+static int parse_ipv4_n(const char *s, size_t len, struct in_addr *in)
+{
+	const char *end = s + len;
+	const char *first;
+	uint32_t addr = 0;
+	unsigned octet, digits;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (i > 0) {
+			if (s == end || *s != '.')
+				return -1;
+			s++;
+		}
+		octet = 0;
+		first = s;
+		for (digits = 0; s < end && *s >= '0' && *s <= '9'; digits++)
+			octet = octet * 10 + (*s++ - '0');
+		if (digits == 0 || digits > 3 || octet > 255 ||
+		    (digits > 1 && *first == '0'))
+			return -1;
+		addr = (addr << 8) | octet;
+	}
+	if (s != end)
+		return -1;
+	in->s_addr = htonl(addr);
+	return 0;
+}
+
+/*
+ * Parse the len characters at s as "ip:port" without copying them
+ * anywhere but (for IPv6 only) a buffer on the stack.
+ */
+int parse_ip_port_n(const char *s, size_t len, sock_addr *saddr)
+{
+	const char *p = s + len;
+	char abuf[INET6_ADDRSTRLEN];
+	unsigned port = 0;
+	size_t alen;
+
+	while (p > s && p[-1] >= '0' && p[-1] <= '9')
+		p--;
+	if (p == s + len || s + len - p > 5 || p - s < 2 || p[-1] != ':')
+		return -1;
+	alen = p - 1 - s;
+	for (; p < s + len; p++)
+		port = port * 10 + (*p - '0');
+	if (port > 65535)
+		return -1;
+
+	memset(saddr, 0, sizeof(*saddr));
+	if (!memchr(s, ':', alen)) {
+		saddr->ip.sin_family = AF_INET;
+		saddr->ip.sin_port   = htons(port);
+		return parse_ipv4_n(s, alen, &saddr->ip.sin_addr);
+	}
+
+	if (alen >= sizeof(abuf))
+		return -1;
+	memcpy(abuf, s, alen);
+	abuf[alen] = 0;
+	saddr->ip6.sin6_family = AF_INET6;
+	saddr->ip6.sin6_port   = htons(port);
+	if (inet_pton(AF_INET6, abuf, &saddr->ip6.sin6_addr) != 1)
+		return -1;
+	return 0;
+}
+
+int build_tickle_pkt(struct tickle_pkt *pkt, const sock_addr *dst,
+		     const sock_addr *src,
+		     uint32_t seq, uint32_t ack, int rst)
+{
+	uint32_t sum;
+
+	memset(pkt, 0, sizeof(*pkt));
+	pkt->family = src->sa.sa_family;
+
+	switch (src->ip.sin_family) {
+	case AF_INET:
+		pkt->u.ip4.ip.version  = 4;
+		pkt->u.ip4.ip.ihl      = sizeof(pkt->u.ip4.ip)/4;
+		pkt->u.ip4.ip.tot_len  = htons(sizeof(pkt->u.ip4));
+		pkt->u.ip4.ip.ttl      = 255;
+		pkt->u.ip4.ip.protocol = IPPROTO_TCP;
+		pkt->u.ip4.ip.saddr    = src->ip.sin_addr.s_addr;
+		pkt->u.ip4.ip.daddr    = dst->ip.sin_addr.s_addr;
+		pkt->u.ip4.ip.check    = 0;
+
+		pkt->tcp = &pkt->u.ip4.tcp;
+		pkt->len = sizeof(pkt->u.ip4);
+		sum = tcp_pseudo_sum(&pkt->u.ip4.ip, sizeof(struct tcphdr));
+		break;
+
+	case AF_INET6:
+		pkt->u.ip6.ip6.ip6_vfc  = 0x60;
+		pkt->u.ip6.ip6.ip6_plen = htons(sizeof(struct tcphdr));
+		pkt->u.ip6.ip6.ip6_nxt  = IPPROTO_TCP;
+		pkt->u.ip6.ip6.ip6_hlim = 64;
+		pkt->u.ip6.ip6.ip6_src  = src->ip6.sin6_addr;
+		pkt->u.ip6.ip6.ip6_dst  = dst->ip6.sin6_addr;
+
+		pkt->tcp = &pkt->u.ip6.tcp;
+		pkt->len = sizeof(pkt->u.ip6);
+		sum = tcp_pseudo_sum6(&pkt->u.ip6.ip6, sizeof(struct tcphdr));
+		break;
+
+	default:
+		fprintf(stderr, "Not an ipv4/v6 address\n");
+		return -1;
+	}
+
+	/* both address families carry the port at the same offset */
+	pkt->tcp->source  = src->ip.sin_port;
+	pkt->tcp->dest    = dst->ip.sin_port;
+	pkt->tcp->seq     = seq;
+	pkt->tcp->ack_seq = ack;
+	pkt->tcp->ack     = 1;
+	if (rst)
+		pkt->tcp->rst = 1;
+	pkt->tcp->doff    = sizeof(struct tcphdr)/4;
+	pkt->tcp->window  = htons(1234);
+	pkt->tcp->check   = csum_finish(csum_partial(pkt->tcp,
+						sizeof(struct tcphdr), sum));
+	return 0;
+}
+
+void tickle_pkt_set_seq(struct tickle_pkt *pkt, uint32_t seq, uint32_t ack)
+{
+	struct tcphdr *tcp = pkt->tcp;
+
+	tcp->check   = csum_replace32(tcp->check, tcp->seq, seq);
+	tcp->check   = csum_replace32(tcp->check, tcp->ack_seq, ack);
+	tcp->seq     = seq;
+	tcp->ack_seq = ack;
+}
 
-	s = strdup(addr);
-	if (!s) {
-		fprintf(stderr, "Failed strdup()\n");
+void tickle_pkt_set_rst(struct tickle_pkt *pkt, int rst)
+{
+	struct tcphdr *tcp = pkt->tcp;
+	uint16_t old, new;
+
+	/* doff and the flags share the 16 bit word at offset 12 */
+	memcpy(&old, (uint8_t *)tcp + 12, sizeof(old));
+	tcp->rst = rst ? 1 : 0;
+	memcpy(&new, (uint8_t *)tcp + 12, sizeof(new));
+	tcp->check = csum_replace16(tcp->check, old, new);
+}
+
+static uint64_t mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* pps of 0 means no rate limit */
+int sender_init(struct tickle_sender *snd, unsigned pps)
+{
+	memset(snd, 0, sizeof(*snd));
+	snd->s4 = -1;
+	snd->s6 = -1;
+
+	snd->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (snd->tfd == -1) {
+		fprintf(stderr, "Failed to create timer (%s)\n", strerror(errno));
 		return -1;
 	}
 
-	p = rindex(s, ':');
-	if (!p) {
-		fprintf(stderr, "This addr: %s does not contain a port number\n", s);
-		free(s);
+	if (pps) {
+		snd->interval_ns = 1000000000 / pps;
+		/* allow bursts of up to 10ms worth of packets */
+		snd->burst_ns = snd->interval_ns > 10000000 ?
+			snd->interval_ns : 10000000;
+		snd->credit_ns = snd->burst_ns;
+		snd->last_ns = mono_ns();
+	}
+	return 0;
+}
+
+void sender_close(struct tickle_sender *snd)
+{
+	if (snd->s4 != -1)
+		close(snd->s4);
+	if (snd->s6 != -1)
+		close(snd->s6);
+	if (snd->tfd != -1)
+		close(snd->tfd);
+}
+
+static int sender_arm(struct tickle_sender *snd, uint64_t when_ns)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec  = when_ns / 1000000000;
+	its.it_value.tv_nsec = when_ns % 1000000000;
+	if (timerfd_settime(snd->tfd, TFD_TIMER_ABSTIME, &its, NULL)) {
+		fprintf(stderr, "Failed to arm timer (%s)\n", strerror(errno));
 		return -1;
 	}
-	
-	port = strtoul(p+1, &endp, 10);
-	if (!endp || *endp != 0) {
-		fprintf(stderr, "Trailing garbage after the port in %s\n", s);
-		free(s);
+	return 0;
+}
+
+int sender_sleep_until(struct tickle_sender *snd, uint64_t when_ns)
+{
+	uint64_t expirations;
+
+	if (when_ns <= mono_ns())
+		return 0;
+
+	if (sender_arm(snd, when_ns))
 		return -1;
+	while (read(snd->tfd, &expirations, sizeof(expirations)) < 0) {
+		if (errno != EINTR) {
+			fprintf(stderr, "Failed to wait for timer (%s)\n", strerror(errno));
+			return -1;
+		}
 	}
-	*p = 0;
+	return 0;
+}
 
-	ret = parse_ip(s, NULL, port, saddr);
-	free(s);
-	return ret;
+/*
+ * How long until the rate limit allows one more packet; if it does
+ * now (0), the packet is paid for.
+ */
+static uint64_t sender_due(struct tickle_sender *snd)
+{
+	uint64_t now;
+
+	if (!snd->interval_ns)
+		return 0;
+
+	now = mono_ns();
+	snd->credit_ns += now - snd->last_ns;
+	if (snd->credit_ns > snd->burst_ns)
+		snd->credit_ns = snd->burst_ns;
+	snd->last_ns = now;
+
+	if (snd->credit_ns < snd->interval_ns)
+		return snd->interval_ns - snd->credit_ns;
+	snd->credit_ns -= snd->interval_ns;
+	return 0;
+}
+
+/* Wait until the rate limit allows one more packet */
+int sender_pace(struct tickle_sender *snd)
+{
+	uint64_t wait;
+
+	while ((wait = sender_due(snd)) != 0) {
+		if (sender_sleep_until(snd, mono_ns() + wait))
+			return -1;
+	}
+	return 0;
 }
 
-int send_tickle_ack(const sock_addr *dst, 
-		    const sock_addr *src, 
-		    uint32_t seq, uint32_t ack, int rst)
+static int sender_socket(struct tickle_sender *snd, int family)
 {
 	int s;
-	int ret;
 	uint32_t one = 1;
-	uint16_t tmpport;
-	sock_addr *tmpdest;
-	struct {
-		struct iphdr ip;
-		struct tcphdr tcp;
-	} ip4pkt;
-	struct {
-		struct ip6_hdr ip6;
-		struct tcphdr tcp;
-	} ip6pkt;
 
-	switch (src->ip.sin_family) {
-	case AF_INET:
-		memset(&ip4pkt, 0, sizeof(ip4pkt));
-		ip4pkt.ip.version  = 4;
-		ip4pkt.ip.ihl      = sizeof(ip4pkt.ip)/4;
-		ip4pkt.ip.tot_len  = htons(sizeof(ip4pkt));
-		ip4pkt.ip.ttl      = 255;
-		ip4pkt.ip.protocol = IPPROTO_TCP;
-		ip4pkt.ip.saddr    = src->ip.sin_addr.s_addr;
-		ip4pkt.ip.daddr    = dst->ip.sin_addr.s_addr;
-		ip4pkt.ip.check    = 0;
-
-		ip4pkt.tcp.source  = src->ip.sin_port;
-		ip4pkt.tcp.dest    = dst->ip.sin_port;
-		ip4pkt.tcp.seq     = seq;
-		ip4pkt.tcp.ack_seq = ack;
-		ip4pkt.tcp.ack     = 1;
-		if (rst)
-			ip4pkt.tcp.rst = 1;
-		ip4pkt.tcp.doff    = sizeof(ip4pkt.tcp)/4;
-		ip4pkt.tcp.window   = htons(1234);
-		ip4pkt.tcp.check    = tcp_checksum((uint16_t *)&ip4pkt.tcp, sizeof(ip4pkt.tcp), &ip4pkt.ip);
-
-		s = socket(AF_INET, SOCK_RAW, htons(IPPROTO_RAW));
+	if (family == AF_INET) {
+		if (snd->s4 != -1)
+			return snd->s4;
+
+		s = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
 		if (s == -1) {
 			fprintf(stderr, "Failed to open raw socket (%s)\n", strerror(errno));
 			return -1;
 		}
-
-		ret = setsockopt(s, SOL_IP, IP_HDRINCL, &one, sizeof(one));
-		if (ret != 0) {
+		if (setsockopt(s, SOL_IP, IP_HDRINCL, &one, sizeof(one)) != 0) {
 			fprintf(stderr, "Failed to setup IP headers (%s)\n", strerror(errno));
 			close(s);
 			return -1;
 		}
-
-		set_nonblocking(s);
 		set_close_on_exec(s);
+		return snd->s4 = s;
+	}
 
-		ret = sendto(s, &ip4pkt, sizeof(ip4pkt), 0, 
-			     (const struct sockaddr *)&dst->ip, sizeof(dst->ip));
-		close(s);
-		if (ret != sizeof(ip4pkt)) {
-			fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
-			return -1;
-		}
-		break;
-
-        case AF_INET6:
-		memset(&ip6pkt, 0, sizeof(ip6pkt));
-		ip6pkt.ip6.ip6_vfc  = 0x60;
-		ip6pkt.ip6.ip6_plen = htons(20);
-		ip6pkt.ip6.ip6_nxt  = IPPROTO_TCP;
-		ip6pkt.ip6.ip6_hlim = 64;
-		ip6pkt.ip6.ip6_src  = src->ip6.sin6_addr;
-		ip6pkt.ip6.ip6_dst  = dst->ip6.sin6_addr;
-
-		ip6pkt.tcp.source   = src->ip6.sin6_port;
-		ip6pkt.tcp.dest     = dst->ip6.sin6_port;
-		ip6pkt.tcp.seq      = seq;
-		ip6pkt.tcp.ack_seq  = ack;
-		ip6pkt.tcp.ack      = 1;
-		if (rst)
-			ip6pkt.tcp.rst      = 1;
-		ip6pkt.tcp.doff     = sizeof(ip6pkt.tcp)/4;
-		ip6pkt.tcp.window   = htons(1234);
-		ip6pkt.tcp.check    = tcp_checksum6((uint16_t *)&ip6pkt.tcp, sizeof(ip6pkt.tcp), &ip6pkt.ip6);
-
-		s = socket(PF_INET6, SOCK_RAW, IPPROTO_RAW);
-		if (s == -1) {
-			fprintf(stderr, "Failed to open sending socket\n");
-			return -1;
-                }
-
-		tmpdest = discard_const(dst);
-		tmpport = tmpdest->ip6.sin6_port;
+	if (snd->s6 != -1)
+		return snd->s6;
 
-		tmpdest->ip6.sin6_port = 0;
-		ret = sendto(s, &ip6pkt, sizeof(ip6pkt), 0, (const struct sockaddr *)&dst->ip6, sizeof(dst->ip6));
-		tmpdest->ip6.sin6_port = tmpport;
-		close(s);
+	s = socket(PF_INET6, SOCK_RAW, IPPROTO_RAW);
+	if (s == -1) {
+		fprintf(stderr, "Failed to open sending socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	set_close_on_exec(s);
+	return snd->s6 = s;
+}
 
-		if (ret != sizeof(ip6pkt)) {
-			fprintf(stderr, "Failed sendto (%s)\n", strerror(errno));
-			return -1;
-		}
-		break;
+/*
+ * Send one packet right away; the sockets are opened on first use and
+ * kept.  They block, so a full socket buffer slows us down instead of
+ * dropping packets.
+ */
+int send_tickle_pkt(struct tickle_sender *snd, const struct tickle_pkt *pkt,
+		    const sock_addr *dst)
+{
+	int s;
+	int ret;
+	sock_addr to;
 
-	default:
+	if (pkt->family != AF_INET && pkt->family != AF_INET6) {
 		fprintf(stderr, "Not an ipv4/v6 address\n");
 		return -1;
 	}
+	s = sender_socket(snd, pkt->family);
+	if (s == -1) {
+		stats_send_error(errno);
+		return -1;
+	}
+
+	if (pkt->family == AF_INET) {
+		ret = sendto(s, &pkt->u.ip4, pkt->len, 0, 
+			     (const struct sockaddr *)&dst->ip, sizeof(dst->ip));
+	} else {
+		/* raw IPv6 sockets want the port to be zero */
+		to.ip6 = dst->ip6;
+		to.ip6.sin6_port = 0;
+		ret = sendto(s, &pkt->u.ip6, pkt->len, 0, (const struct sockaddr *)&to.ip6, sizeof(to.ip6));
+	}
 
+	if (ret != (int)pkt->len) {
+		stats_send_error(errno);
+		return -1;
+	}
+	stats.sent++;
 	return 0;
 }
 
-static void usage(void)
+int format_ip_port(const sock_addr *saddr, char *buf, size_t len)
 {
-	printf("Usage: /usr/lib/heartbeat/tickle_tcp [ -n num ]\n");
-	printf("Please note that this program need to read the list of\n");
-	printf("{local_ip:port remote_ip:port} from stdin.\n");
-	exit(1);
+	char addr[INET6_ADDRSTRLEN];
+	const void *a;
+
+	if (saddr->sa.sa_family == AF_INET)
+		a = &saddr->ip.sin_addr;
+	else
+		a = &saddr->ip6.sin6_addr;
+
+	if (!inet_ntop(saddr->sa.sa_family, a, addr, sizeof(addr))) {
+		fprintf(stderr, "Failed inet_ntop (%s)\n", strerror(errno));
+		return -1;
+	}
+	snprintf(buf, len, "%s:%u", addr, ntohs(saddr->ip.sin_port));
+	return 0;
 }
 
-#define OPTION_STRING "n:h"
+static void diag_to_sock_addr(const struct inet_diag_msg *msg,
+			      const __be32 *addr, __be16 port, sock_addr *saddr)
+{
+	memset(saddr, 0, sizeof(*saddr));
+	if (msg->idiag_family == AF_INET) {
+		saddr->ip.sin_family = AF_INET;
+		saddr->ip.sin_port   = port;
+		memcpy(&saddr->ip.sin_addr, addr, 4);
+	} else {
+		saddr->ip6.sin6_family = AF_INET6;
+		saddr->ip6.sin6_port   = port;
+		memcpy(&saddr->ip6.sin6_addr, addr, 16);
+		if (IN6_IS_ADDR_LINKLOCAL(&saddr->ip6.sin6_addr))
+			saddr->ip6.sin6_scope_id = msg->id.idiag_if;
+	}
+}
 
-int main(int argc, char *argv[])
+/*
+ * Enumerate the established TCP connections whose local address is
+ * local with a single NETLINK_SOCK_DIAG dump.  The address is matched
+ * by a bytecode filter in the kernel, so only the sockets we care
+ * about are copied out, however large the connection table is.
+ */
+int diag_dump(const sock_addr *local, tuple_fn *fn, void *priv)
 {
-	int optchar, i, num = 1, cont = 1;
+	int fd, ret = -1;
+	size_t alen;
+	ssize_t len;
+	struct sockaddr_nl nladdr;
+	struct {
+		struct nlmsghdr nlh;
+		struct inet_diag_req_v2 r;
+	} req;
+	struct rtattr rta;
+	uint32_t bc[(sizeof(struct inet_diag_bc_op) +
+		     sizeof(struct inet_diag_hostcond) + 16) / 4];
+	struct inet_diag_bc_op *op = (struct inet_diag_bc_op *)bc;
+	struct inet_diag_hostcond *cond = (struct inet_diag_hostcond *)(op + 1);
+	struct iovec iov[3];
+	struct msghdr mh;
+	uint32_t buf[8192];
+	struct nlmsghdr *nlh;
+	struct inet_diag_msg *msg;
 	sock_addr src, dst;
-	char addrline[128], addr1[64], addr2[64];
 
-	while(cont) {
-		optchar = getopt(argc, argv, OPTION_STRING);
-		switch(optchar) {
-		case 'n':
-			num = atoi(optarg);
-			break;
-		case 'h':
-			usage();
-			exit(EXIT_SUCCESS);
-			break;
-		case EOF:
-			cont = 0;
-			break;
-		default:
-			fprintf(stderr, "unknown option, please use '-h' for usage.\n");
-			exit(EXIT_FAILURE);
-			break;
-		};
+	if (local->sa.sa_family == AF_INET) {
+		alen = 4;
+		memcpy(cond->addr, &local->ip.sin_addr, alen);
+	} else {
+		alen = 16;
+		memcpy(cond->addr, &local->ip6.sin6_addr, alen);
 	}
 
-	while(fgets(addrline, sizeof(addrline), stdin)) {
-		sscanf(addrline, "%s %s", addr1, addr2);
+	/*
+	 * One S_COND op; "yes" jumps exactly to the end of the program
+	 * (accept), "no" jumps past it (reject).
+	 */
+	op->code = INET_DIAG_BC_S_COND;
+	op->yes  = sizeof(*op) + sizeof(*cond) + alen;
+	op->no   = op->yes + 4;
+	cond->family     = local->sa.sa_family;
+	cond->prefix_len = alen * 8;
+	cond->port       = -1;
 
-		if (parse_ip_port(addr1, &src)) {
-			fprintf(stderr, "Bad IP:port '%s'\n", addr1);
-			return -1;
-		}
-		if (parse_ip_port(addr2, &dst)) {
-			fprintf(stderr, "Bad IP:port '%s'\n", addr2);
-			return -1;
+	memset(&rta, 0, sizeof(rta));
+	rta.rta_type = INET_DIAG_REQ_BYTECODE;
+	rta.rta_len  = RTA_LENGTH(op->yes);
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len      = sizeof(req) + RTA_ALIGN(rta.rta_len);
+	req.nlh.nlmsg_type     = SOCK_DIAG_BY_FAMILY;
+	req.nlh.nlmsg_flags    = NLM_F_REQUEST | NLM_F_DUMP;
+	req.nlh.nlmsg_seq      = 1;
+	req.r.sdiag_family     = local->sa.sa_family;
+	req.r.sdiag_protocol   = IPPROTO_TCP;
+	req.r.idiag_states     = 1 << TCP_ESTABLISHED;
+
+	iov[0].iov_base = &req;
+	iov[0].iov_len  = sizeof(req);
+	iov[1].iov_base = &rta;
+	iov[1].iov_len  = sizeof(rta);
+	iov[2].iov_base = bc;
+	iov[2].iov_len  = op->yes;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_name    = &nladdr;
+	mh.msg_namelen = sizeof(nladdr);
+	mh.msg_iov     = iov;
+	mh.msg_iovlen  = 3;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_SOCK_DIAG);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open sock_diag socket (%s)\n", strerror(errno));
+		return -1;
+	}
+	set_close_on_exec(fd);
+
+	if (sendmsg(fd, &mh, 0) < 0) {
+		fprintf(stderr, "Failed to send sock_diag request (%s)\n", strerror(errno));
+		goto out;
+	}
+
+	for (;;) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Failed to read sock_diag reply (%s)\n", strerror(errno));
+			goto out;
 		}
-	
-		for (i = 1; i <= num; i++) {
-			if (send_tickle_ack(&dst, &src, 0, 0, 0)) {
-				fprintf(stderr, "Error while sending tickle ack from '%s' to '%s'\n",
-					addr1, addr2);
-				return -1;
+		if (len == 0)
+			break;
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type == NLMSG_DONE) {
+				ret = 0;
+				goto out;
+			}
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(nlh);
+				fprintf(stderr, "sock_diag dump failed (%s)\n",
+					strerror(-err->error));
+				goto out;
 			}
+			msg = NLMSG_DATA(nlh);
+			diag_to_sock_addr(msg, msg->id.idiag_src, msg->id.idiag_sport, &src);
+			diag_to_sock_addr(msg, msg->id.idiag_dst, msg->id.idiag_dport, &dst);
+			if (fn(&src, &dst, priv))
+				goto out;
 		}
+	}
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Write a state file next to its final location and rename it into
+ * place on close, so readers never see a half written file.  A path
+ * of "-" writes to stdout.
+ */
+int state_writer_open(struct state_writer *w, const char *path)
+{
+	memset(w, 0, sizeof(*w));
+	if (strcmp(path, "-") == 0) {
+		w->f = stdout;
+		return 0;
+	}
 
+	w->path = strdup(path);
+	w->tmppath = malloc(strlen(path) + sizeof(".new"));
+	if (!w->path || !w->tmppath) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		goto err;
+	}
+	sprintf(w->tmppath, "%s.new", path);
+
+	w->f = fopen(w->tmppath, "w");
+	if (!w->f) {
+		fprintf(stderr, "Failed to open %s (%s)\n", w->tmppath, strerror(errno));
+		goto err;
 	}
 	return 0;
+err:
+	free(w->path);
+	free(w->tmppath);
+	return -1;
+}
+
+int state_writer_close(struct state_writer *w)
+{
+	int ret = 0;
+
+	if (!w->path)
+		return fflush(w->f) ? -1 : 0;
+
+	if (fflush(w->f) || fsync(fileno(w->f))) {
+		fprintf(stderr, "Failed to write %s (%s)\n", w->tmppath, strerror(errno));
+		ret = -1;
+	}
+	if (fclose(w->f) && !ret) {
+		fprintf(stderr, "Failed to write %s (%s)\n", w->tmppath, strerror(errno));
+		ret = -1;
+	}
+	if (!ret && rename(w->tmppath, w->path)) {
+		fprintf(stderr, "Failed to rename %s (%s)\n", w->tmppath, strerror(errno));
+		ret = -1;
+	}
+	if (ret)
+		unlink(w->tmppath);
+	free(w->path);
+	free(w->tmppath);
+	return ret;
+}
+
+/* Drop the new file and keep the previous state file */
+void state_writer_abort(struct state_writer *w)
+{
+	if (!w->path)
+		return;
+
+	fclose(w->f);
+	unlink(w->tmppath);
+	free(w->path);
+	free(w->tmppath);
+}
+
+/* FNV-1a; pass 2166136261 as h to start a new hash */
+uint32_t hash32(const void *buf, size_t n, uint32_t h)
+{
+	const uint8_t *p = buf;
+
+	while (n--) {
+		h ^= *p++;
+		h *= 16777619;
+	}
+	return h;
+}
+
+void tuple_to_rec(const sock_addr *src, const sock_addr *dst, void *rec)
+{
+	struct state_rec4 *r4 = rec;
+	struct state_rec6 *r6 = rec;
+
+	if (src->sa.sa_family == AF_INET) {
+		r4->src   = src->ip.sin_addr.s_addr;
+		r4->dst   = dst->ip.sin_addr.s_addr;
+		r4->sport = src->ip.sin_port;
+		r4->dport = dst->ip.sin_port;
+	} else {
+		memcpy(r6->src, &src->ip6.sin6_addr, 16);
+		memcpy(r6->dst, &dst->ip6.sin6_addr, 16);
+		r6->sport = src->ip6.sin6_port;
+		r6->dport = dst->ip6.sin6_port;
+	}
+}
+
+void rec_to_tuple(int family, const void *rec, sock_addr *src, sock_addr *dst)
+{
+	const struct state_rec4 *r4 = rec;
+	const struct state_rec6 *r6 = rec;
+
+	memset(src, 0, sizeof(*src));
+	memset(dst, 0, sizeof(*dst));
+	if (family == AF_INET) {
+		src->ip.sin_family      = AF_INET;
+		src->ip.sin_addr.s_addr = r4->src;
+		src->ip.sin_port        = r4->sport;
+		dst->ip.sin_family      = AF_INET;
+		dst->ip.sin_addr.s_addr = r4->dst;
+		dst->ip.sin_port        = r4->dport;
+	} else {
+		src->ip6.sin6_family = AF_INET6;
+		memcpy(&src->ip6.sin6_addr, r6->src, 16);
+		src->ip6.sin6_port   = r6->sport;
+		dst->ip6.sin6_family = AF_INET6;
+		memcpy(&dst->ip6.sin6_addr, r6->dst, 16);
+		dst->ip6.sin6_port   = r6->dport;
+	}
+}
+
+int tuple_vec_add(const sock_addr *src, const sock_addr *dst, void *priv)
+{
+	struct tuple_vec *v = priv;
+	uint8_t *recs;
+
+	if (!v->family) {
+		v->family  = src->sa.sa_family;
+		v->recsize = v->family == AF_INET ?
+			sizeof(struct state_rec4) : sizeof(struct state_rec6);
+	} else if (v->family != src->sa.sa_family) {
+		fprintf(stderr, "Cannot mix IPv4 and IPv6 connections in one state file\n");
+		return -1;
+	}
+
+	if (v->count == v->alloc) {
+		v->alloc = v->alloc ? v->alloc * 2 : 64;
+		recs = realloc(v->recs, v->alloc * v->recsize);
+		if (!recs) {
+			fprintf(stderr, "Failed to allocate memory\n");
+			return -1;
+		}
+		v->recs = recs;
+	}
+	tuple_to_rec(src, dst, v->recs + v->count * v->recsize);
+	v->count++;
+	return 0;
+}
+
+void tuple_vec_free(struct tuple_vec *v)
+{
+	free(v->recs);
+	memset(v, 0, sizeof(*v));
+}
+
+static size_t tuple_key_len(const struct tuple_key *key)
+{
+	return offsetof(struct tuple_key, rec) + (key->family == 4 ?
+		sizeof(struct state_rec4) : sizeof(struct state_rec6));
+}
+
+static void tuple_to_key(const sock_addr *src, const sock_addr *dst,
+			 struct tuple_key *key)
+{
+	memset(key, 0, sizeof(*key));
+	key->family = src->sa.sa_family == AF_INET ? 4 : 6;
+	tuple_to_rec(src, dst, &key->rec);
+}
+
+int tuple_set_init(struct tuple_set *set, size_t hint)
+{
+	set->size = 64;
+	while (set->size < hint * 2)
+		set->size *= 2;
+	set->count = 0;
+	set->slots = calloc(set->size, sizeof(*set->slots));
+	if (!set->slots) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		return -1;
+	}
+	return 0;
+}
+
+void tuple_set_free(struct tuple_set *set)
+{
+	free(set->slots);
+	memset(set, 0, sizeof(*set));
+}
+
+static size_t tuple_set_slot(const struct tuple_set *set,
+			     const struct tuple_key *key)
+{
+	size_t len = tuple_key_len(key);
+	size_t i = hash32(key, len, 2166136261U) & (set->size - 1);
+
+	while (set->slots[i].family &&
+	       memcmp(&set->slots[i], key, len) != 0)
+		i = (i + 1) & (set->size - 1);
+	return i;
+}
+
+static int tuple_set_grow(struct tuple_set *set)
+{
+	struct tuple_set bigger;
+	size_t i;
+
+	if (tuple_set_init(&bigger, set->size))
+		return -1;
+	for (i = 0; i < set->size; i++) {
+		if (set->slots[i].family)
+			bigger.slots[tuple_set_slot(&bigger, &set->slots[i])] =
+				set->slots[i];
+	}
+	bigger.count = set->count;
+	free(set->slots);
+	*set = bigger;
+	return 0;
+}
+
+/* Returns 1 if key was added, 0 if it was already there */
+int tuple_set_add(struct tuple_set *set, const struct tuple_key *key)
+{
+	size_t i;
+
+	/* keep the load factor under 1/2 */
+	if ((set->count + 1) * 2 > set->size && tuple_set_grow(set))
+		return -1;
+
+	i = tuple_set_slot(set, key);
+	if (set->slots[i].family)
+		return 0;
+	set->slots[i] = *key;
+	set->count++;
+	return 1;
+}
+
+/* Returns 1 if key was removed, 0 if it was not there */
+int tuple_set_del(struct tuple_set *set, const struct tuple_key *key)
+{
+	size_t i, j, home, mask = set->size - 1;
+
+	i = tuple_set_slot(set, key);
+	if (!set->slots[i].family)
+		return 0;
+
+	/*
+	 * Backward shift deletion: move up every following entry of the
+	 * cluster whose home slot does not lie between the hole and it.
+	 */
+	j = i;
+	for (;;) {
+		set->slots[i].family = 0;
+		do {
+			j = (j + 1) & mask;
+			if (!set->slots[j].family) {
+				set->count--;
+				return 1;
+			}
+			home = hash32(&set->slots[j], tuple_key_len(&set->slots[j]),
+				      2166136261U) & mask;
+		} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+		set->slots[i] = set->slots[j];
+		i = j;
+	}
+}
+
+int tuple_set_insert(const sock_addr *src, const sock_addr *dst, void *priv)
+{
+	struct tuple_key key;
+
+	tuple_to_key(src, dst, &key);
+	return tuple_set_add(priv, &key) < 0 ? -1 : 0;
+}
+
+int tuple_set_walk(struct tuple_set *set, tuple_fn *fn, void *priv)
+{
+	size_t i;
+	sock_addr src, dst;
+
+	for (i = 0; i < set->size; i++) {
+		if (!set->slots[i].family)
+			continue;
+		rec_to_tuple(set->slots[i].family == 4 ? AF_INET : AF_INET6,
+			     &set->slots[i].rec, &src, &dst);
+		if (fn(&src, &dst, priv))
+			return -1;
+	}
+	return 0;
+}
+
+static int cmp_rec4(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct state_rec4));
+}
+
+static int cmp_rec6(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct state_rec6));
+}
+
+int write_binary_state(struct state_writer *w, struct tuple_vec *v,
+		       unsigned gen)
+{
+	struct state_hdr hdr;
+
+	if (v->count)
+		qsort(v->recs, v->count, v->recsize,
+		      v->family == AF_INET ? cmp_rec4 : cmp_rec6);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, STATE_MAGIC, sizeof(hdr.magic));
+	hdr.version = STATE_VERSION;
+	hdr.family  = v->family == AF_INET6 ? 6 : 4;
+	hdr.generation = htons(gen);
+	hdr.count   = htonl(v->count);
+	hdr.csum    = htonl(hash32(v->recs, v->count * v->recsize, 2166136261U));
+
+	if (fwrite(&hdr, sizeof(hdr), 1, w->f) != 1 ||
+	    (v->count && fwrite(v->recs, v->recsize, v->count, w->f) != v->count)) {
+		fprintf(stderr, "Failed to write state file (%s)\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int read_binary_state(const char *path, const uint8_t *map, size_t size,
+			     tuple_fn *fn, void *priv)
+{
+	const struct state_hdr *hdr = (const struct state_hdr *)map;
+	const uint8_t *rec;
+	size_t recsize, count, i;
+	int family;
+	sock_addr src, dst;
+
+	if (hdr->version != STATE_VERSION) {
+		fprintf(stderr, "%s: unsupported state file version %d\n",
+			path, hdr->version);
+		return -1;
+	}
+	switch (hdr->family) {
+	case 4:
+		family  = AF_INET;
+		recsize = sizeof(struct state_rec4);
+		break;
+	case 6:
+		family  = AF_INET6;
+		recsize = sizeof(struct state_rec6);
+		break;
+	default:
+		fprintf(stderr, "%s: bad address family %d\n", path, hdr->family);
+		return -1;
+	}
+
+	count = ntohl(hdr->count);
+	rec = map + sizeof(*hdr);
+	if (size != sizeof(*hdr) + count * recsize) {
+		fprintf(stderr, "%s: truncated state file\n", path);
+		return -1;
+	}
+	if (ntohl(hdr->csum) != hash32(rec, count * recsize, 2166136261U)) {
+		fprintf(stderr, "%s: state file checksum mismatch\n", path);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++, rec += recsize) {
+		rec_to_tuple(family, rec, &src, &dst);
+		if (fn(&src, &dst, priv))
+			return -1;
+	}
+	return 0;
+}
+
+static int is_blank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/*
+ * The historical format: one "local_ip:port remote_ip:port" per line.
+ * The buffer is parsed where it lies, nothing is copied or allocated;
+ * blank lines and "#" comments are skipped, bad lines are counted and
+ * skipped.
+ */
+int parse_text_state(const char *buf, size_t len, tuple_fn *fn, void *priv)
+{
+	const char *p = buf, *end = buf + len, *eol;
+	const char *a1, *a2;
+	size_t l1, l2;
+	sock_addr src, dst;
+
+	for (; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+
+		while (p < eol && is_blank(*p))
+			p++;
+		if (p == eol || *p == '#')
+			continue;
+		a1 = p;
+		while (p < eol && !is_blank(*p))
+			p++;
+		l1 = p - a1;
+		while (p < eol && is_blank(*p))
+			p++;
+		a2 = p;
+		while (p < eol && !is_blank(*p))
+			p++;
+		l2 = p - a2;
+
+		/* a bad line costs only its own connection */
+		if (parse_ip_port_n(a1, l1, &src)) {
+			fprintf(stderr, "Bad IP:port '%.*s'\n", (int)l1, a1);
+			stats.bad_lines++;
+			continue;
+		}
+		if (parse_ip_port_n(a2, l2, &dst)) {
+			fprintf(stderr, "Bad IP:port '%.*s'\n", (int)l2, a2);
+			stats.bad_lines++;
+			continue;
+		}
+		if (src.sa.sa_family != dst.sa.sa_family) {
+			fprintf(stderr, "Address families of '%.*s' and '%.*s' differ\n",
+				(int)l1, a1, (int)l2, a2);
+			stats.bad_lines++;
+			continue;
+		}
+
+		if (fn(&src, &dst, priv))
+			return -1;
+	}
+	return 0;
+}
+
+#define STREAM_BUFSIZE	(1024 * 1024)
+
+/*
+ * Parse the text format from a pipe in large chunks; only an
+ * incomplete last line is carried over to the next read().
+ */
+int read_text_stream(int fd, tuple_fn *fn, void *priv)
+{
+	char *buf, *eol;
+	size_t fill = 0, used;
+	ssize_t len;
+	int ret = -1;
+
+	buf = malloc(STREAM_BUFSIZE);
+	if (!buf) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		return -1;
+	}
+
+	for (;;) {
+		len = read(fd, buf + fill, STREAM_BUFSIZE - fill);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Failed to read input (%s)\n", strerror(errno));
+			goto out;
+		}
+		if (len == 0)
+			break;
+		fill += len;
+
+		eol = memrchr(buf, '\n', fill);
+		if (!eol) {
+			if (fill == STREAM_BUFSIZE) {
+				fprintf(stderr, "Input line too long\n");
+				goto out;
+			}
+			continue;
+		}
+		used = eol + 1 - buf;
+		if (parse_text_state(buf, used, fn, priv))
+			goto out;
+		memmove(buf, buf + used, fill - used);
+		fill -= used;
+	}
+	ret = parse_text_state(buf, fill, fn, priv);
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Read a state file in either format.  Regular files are mmap()ed,
+ * anything else (a pipe, /dev/stdin) is read into memory first.
+ * If gen is not NULL it gets the generation of the file, 0 if it has
+ * none.
+ */
+int read_state_file(const char *path, tuple_fn *fn, void *priv,
+		    unsigned *gen)
+{
+	int fd, ret = -1, mapped = 0;
+	struct stat st;
+	uint8_t *buf = NULL;
+	size_t size = 0, alloc = 0;
+	ssize_t len;
+
+	if (gen)
+		*gen = 0;
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		fprintf(stderr, "Failed to stat %s (%s)\n", path, strerror(errno));
+		goto out;
+	}
+
+	if (S_ISREG(st.st_mode)) {
+		size = st.st_size;
+		if (size == 0) {
+			ret = 0;
+			goto out;
+		}
+		buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED) {
+			fprintf(stderr, "Failed to mmap %s (%s)\n", path, strerror(errno));
+			buf = NULL;
+			goto out;
+		}
+		madvise(buf, size, MADV_SEQUENTIAL);
+		mapped = 1;
+	} else {
+		for (;;) {
+			if (size == alloc) {
+				uint8_t *nbuf;
+
+				alloc = alloc ? alloc * 2 : 65536;
+				nbuf = realloc(buf, alloc);
+				if (!nbuf) {
+					fprintf(stderr, "Failed to allocate memory\n");
+					goto out;
+				}
+				buf = nbuf;
+			}
+			len = read(fd, buf + size, alloc - size);
+			if (len < 0) {
+				if (errno == EINTR)
+					continue;
+				fprintf(stderr, "Failed to read %s (%s)\n", path, strerror(errno));
+				goto out;
+			}
+			if (len == 0)
+				break;
+			size += len;
+		}
+		if (size == 0) {
+			ret = 0;
+			goto out;
+		}
+	}
+
+	if (size >= sizeof(struct state_hdr) &&
+	    memcmp(buf, STATE_MAGIC, strlen(STATE_MAGIC)) == 0) {
+		if (gen)
+			*gen = ntohs(((const struct state_hdr *)buf)->generation);
+		ret = read_binary_state(path, buf, size, fn, priv);
+	} else {
+		if (gen && size > 13 && memcmp(buf, "# generation ", 13) == 0)
+			*gen = strtoul((const char *)buf + 13, NULL, 10);
+		ret = parse_text_state((const char *)buf, size, fn, priv);
+	}
+out:
+	if (mapped)
+		munmap(buf, size);
+	else
+		free(buf);
+	close(fd);
+	return ret;
+}
+
+static char *journal_path(const char *path)
+{
+	char *jpath = malloc(strlen(path) + sizeof(".journal"));
+
+	if (!jpath) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		return NULL;
+	}
+	sprintf(jpath, "%s.journal", path);
+	return jpath;
+}
+
+/*
+ * Apply the journal of generation gen to set; a torn entry at the end
+ * is ignored.  Returns 1, with set untouched, if the journal is of
+ * another generation or has no header yet.
+ */
+int replay_journal(const char *path, struct tuple_set *set, unsigned gen)
+{
+	FILE *f;
+	struct journal_hdr hdr;
+	struct journal_ent ent;
+	struct tuple_key key;
+	size_t reclen;
+	int ret = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		if (errno == ENOENT)
+			return 0;
+		fprintf(stderr, "Failed to open %s (%s)\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic)) ||
+	    ntohs(hdr.generation) != gen) {
+		fclose(f);
+		return 1;
+	}
+	while (fread(&ent, sizeof(ent), 1, f) == 1) {
+		memset(&key, 0, sizeof(key));
+		key.family = ent.family;
+		if (ent.family == 4) {
+			reclen = sizeof(struct state_rec4);
+		} else if (ent.family == 6) {
+			reclen = sizeof(struct state_rec6);
+		} else {
+			fprintf(stderr, "%s: bad journal entry\n", path);
+			ret = -1;
+			break;
+		}
+		if (fread(&key.rec, reclen, 1, f) != 1)
+			break;
+
+		if (ent.op == '+') {
+			if (tuple_set_add(set, &key) < 0) {
+				ret = -1;
+				break;
+			}
+		} else if (ent.op == '-') {
+			tuple_set_del(set, &key);
+		} else {
+			fprintf(stderr, "%s: bad journal entry\n", path);
+			ret = -1;
+			break;
+		}
+	}
+	fclose(f);
+	return ret;
+}
+
+/*
+ * Read a state file together with the journal the recorder keeps
+ * next to it, if there is one.  A journal of another generation is
+ * either newer, if the recorder wrote a new state file and journal
+ * between our reading the two, or older, if it died doing so; read
+ * both again a few times, then go by the state file alone.
+ */
+int read_state(const char *path, tuple_fn *fn, void *priv)
+{
+	struct tuple_set set;
+	struct timespec ts;
+	char *jpath;
+	unsigned gen;
+	int tries, ret = -1;
+
+	jpath = journal_path(path);
+	if (!jpath)
+		return -1;
+	if (access(jpath, F_OK)) {
+		free(jpath);
+		return read_state_file(path, fn, priv, NULL);
+	}
+
+	for (tries = 0; ; tries++) {
+		ret = -1;
+		if (tuple_set_init(&set, 0))
+			goto out;
+		gen = 0;
+		if (access(path, F_OK) == 0 &&
+		    read_state_file(path, tuple_set_insert, &set, &gen))
+			goto out_set;
+		ret = replay_journal(jpath, &set, gen);
+		if (ret <= 0 || tries == 2)
+			break;
+		tuple_set_free(&set);
+		ts.tv_sec = 0;
+		ts.tv_nsec = 10 * 1000000;
+		nanosleep(&ts, NULL);
+	}
+	if (ret < 0)
+		goto out_set;
+	ret = tuple_set_walk(&set, fn, priv);
+out_set:
+	tuple_set_free(&set);
+out:
+	free(jpath);
+	return ret;
+}
+
+/*
+ * Read every state file in a directory, such as a tickle_dir that
+ * csync2 fills with the files of all nodes.  Files being written
+ * (.new), journals and hidden files are skipped.
+ */
+int read_state_dir(const char *path, tuple_fn *fn, void *priv)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	char file[PATH_MAX];
+	size_t len;
+	int ret = 0;
+
+	dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "Failed to open %s (%s)\n", path, strerror(errno));
+		stats.bad_inputs++;
+		return -1;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		len = strlen(de->d_name);
+		if (de->d_name[0] == '.' ||
+		    (len > 4 && strcmp(de->d_name + len - 4, ".new") == 0) ||
+		    (len > 8 && strcmp(de->d_name + len - 8, ".journal") == 0))
+			continue;
+		snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+		if (stat(file, &st) || !S_ISREG(st.st_mode))
+			continue;
+		/* one bad state file must not hide the others */
+		if (read_state(file, fn, priv)) {
+			stats.bad_inputs++;
+			ret = -1;
+		}
+	}
+	closedir(dir);
+	return ret;
+}
+
+/*
+ * The state files of the given VIPs in a tickle directory, named after
+ * the VIP as portblock writes them.  A VIP without a state file had no
+ * connections to save and is skipped; an unreadable one does not keep
+ * the others from being read.
+ */
+int read_vip_states(const char *dir, char **vips, int nvips,
+		    tuple_fn *fn, void *priv)
+{
+	char file[PATH_MAX], *jpath;
+	sock_addr vip;
+	int i, missing, ret = 0;
+
+	for (i = 0; i < nvips; i++) {
+		/* also keeps "../x" and friends out of the path */
+		if (parse_ip(vips[i], NULL, 0, &vip)) {
+			fprintf(stderr, "Bad IP '%s'\n", vips[i]);
+			stats.bad_inputs++;
+			ret = -1;
+			continue;
+		}
+		snprintf(file, sizeof(file), "%s/%s", dir, vips[i]);
+		jpath = journal_path(file);
+		if (!jpath)
+			return -1;
+		missing = access(file, F_OK) && access(jpath, F_OK);
+		free(jpath);
+		if (missing)
+			continue;
+		if (read_state(file, fn, priv)) {
+			stats.bad_inputs++;
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+int write_state(const char *path, struct tuple_set *set, int binary,
+		unsigned gen)
+{
+	struct state_writer w;
+	struct tuple_vec vec;
+	int ret;
+
+	if (state_writer_open(&w, path))
+		return -1;
+	if (binary) {
+		memset(&vec, 0, sizeof(vec));
+		ret = tuple_set_walk(set, tuple_vec_add, &vec);
+		if (!ret)
+			ret = write_binary_state(&w, &vec, gen);
+		tuple_vec_free(&vec);
+	} else {
+		if (gen)
+			fprintf(w.f, "# generation %u\n", gen);
+		ret = tuple_set_walk(set, write_tuple, &w);
+	}
+	if (ret) {
+		state_writer_abort(&w);
+		return -1;
+	}
+	return state_writer_close(&w);
+}
+
+/* Appends journal entries for one poll and writes them in one go */
+struct journal_buf {
+	uint8_t *data;
+	size_t len;
+	size_t alloc;
+	size_t entries;
+};
+
+static int journal_buf_add(struct journal_buf *jb, int op,
+			   const struct tuple_key *key)
+{
+	struct journal_ent ent;
+	size_t reclen = tuple_key_len(key) - offsetof(struct tuple_key, rec);
+	uint8_t *data;
+
+	if (jb->len + sizeof(ent) + reclen > jb->alloc) {
+		jb->alloc = jb->alloc ? jb->alloc * 2 : 4096;
+		data = realloc(jb->data, jb->alloc);
+		if (!data) {
+			fprintf(stderr, "Failed to allocate memory\n");
+			return -1;
+		}
+		jb->data = data;
+	}
+	memset(&ent, 0, sizeof(ent));
+	ent.op = op;
+	ent.family = key->family;
+	memcpy(jb->data + jb->len, &ent, sizeof(ent));
+	memcpy(jb->data + jb->len + sizeof(ent), &key->rec, reclen);
+	jb->len += sizeof(ent) + reclen;
+	jb->entries++;
+	return 0;
+}
+
+/*
+ * Start the journal of generation gen: written next to it and renamed
+ * into place, so a reader sees either the old journal or the new one,
+ * header included.  Returns the fd to append to.
+ */
+static int journal_start(const char *jpath, unsigned gen)
+{
+	struct journal_hdr hdr;
+	char *tmppath;
+	int fd;
+
+	tmppath = malloc(strlen(jpath) + sizeof(".new"));
+	if (!tmppath) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		return -1;
+	}
+	sprintf(tmppath, "%s.new", jpath);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+	hdr.generation = htons(gen);
+
+	fd = open(tmppath, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open %s (%s)\n", tmppath, strerror(errno));
+		free(tmppath);
+		return -1;
+	}
+	if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+	    fdatasync(fd) || rename(tmppath, jpath)) {
+		fprintf(stderr, "Failed to write %s (%s)\n", jpath, strerror(errno));
+		close(fd);
+		unlink(tmppath);
+		free(tmppath);
+		return -1;
+	}
+	set_close_on_exec(fd);
+	free(tmppath);
+	return fd;
+}
+
+/* The generation after gen; 0 means none */
+static unsigned next_generation(unsigned gen)
+{
+	return gen >= 0xffff ? 1 : gen + 1;
+}
+
+static volatile sig_atomic_t recorder_quit;
+
+static void recorder_stop(int signo)
+{
+	recorder_quit = 1;
+}
+
+/*
+ * Keep the state file of local's connections up to date: poll the
+ * kernel every interval seconds and append only what changed to the
+ * journal.  Once the journal holds more entries than there are
+ * connections it is folded into a state file of the next generation
+ * and a new, empty journal is started for it.
+ */
+int record_connections(const sock_addr *local, const char *path,
+		       int interval, int binary)
+{
+	struct tuple_set old, cur, tmp;
+	struct journal_buf jb;
+	struct sigaction sa;
+	struct timespec ts;
+	char *jpath;
+	size_t i, journalled = 0;
+	unsigned gen = 1;
+	int jfd = -1, fd, ret = -1;
+
+	memset(&jb, 0, sizeof(jb));
+	memset(&old, 0, sizeof(old));
+	memset(&cur, 0, sizeof(cur));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = recorder_stop;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	jpath = journal_path(path);
+	if (!jpath)
+		return -1;
+	/* a journal left behind must not meet the new state file */
+	if (unlink(jpath) && errno != ENOENT) {
+		fprintf(stderr, "Failed to remove %s (%s)\n", jpath, strerror(errno));
+		goto out;
+	}
+	if (tuple_set_init(&old, 0) ||
+	    diag_dump(local, tuple_set_insert, &old) ||
+	    write_state(path, &old, binary, gen))
+		goto out;
+
+	jfd = journal_start(jpath, gen);
+	if (jfd == -1)
+		goto out;
+
+	while (!recorder_quit) {
+		ts.tv_sec = interval;
+		ts.tv_nsec = 0;
+		while (nanosleep(&ts, &ts) && errno == EINTR && !recorder_quit)
+			;
+		if (recorder_quit)
+			break;
+
+		if (tuple_set_init(&cur, old.count) ||
+		    diag_dump(local, tuple_set_insert, &cur))
+			goto out;
+
+		jb.len = jb.entries = 0;
+		for (i = 0; i < cur.size; i++) {
+			if (cur.slots[i].family &&
+			    !old.slots[tuple_set_slot(&old, &cur.slots[i])].family &&
+			    journal_buf_add(&jb, '+', &cur.slots[i]))
+				goto out;
+		}
+		for (i = 0; i < old.size; i++) {
+			if (old.slots[i].family &&
+			    !cur.slots[tuple_set_slot(&cur, &old.slots[i])].family &&
+			    journal_buf_add(&jb, '-', &old.slots[i]))
+				goto out;
+		}
+
+		tmp = old;
+		old = cur;
+		cur = tmp;
+		tuple_set_free(&cur);
+
+		if (!jb.entries)
+			continue;
+
+		if (journalled + jb.entries > old.count) {
+			/* compact: the journal outgrew the state it describes */
+			gen = next_generation(gen);
+			if (write_state(path, &old, binary, gen))
+				goto out;
+			fd = journal_start(jpath, gen);
+			if (fd == -1)
+				goto out;
+			close(jfd);
+			jfd = fd;
+			journalled = 0;
+			continue;
+		}
+
+		if (write(jfd, jb.data, jb.len) != (ssize_t)jb.len ||
+		    fdatasync(jfd)) {
+			fprintf(stderr, "Failed to write %s (%s)\n",
+				jpath, strerror(errno));
+			goto out;
+		}
+		journalled += jb.entries;
+	}
+
+	/* leave a compact state file behind, with no journal */
+	if (write_state(path, &old, binary, next_generation(gen)) == 0 &&
+	    (unlink(jpath) == 0 || errno == ENOENT))
+		ret = 0;
+out:
+	if (jfd != -1)
+		close(jfd);
+	tuple_set_free(&old);
+	tuple_set_free(&cur);
+	free(jb.data);
+	free(jpath);
+	return ret;
+}
+
+/* Time to wait for challenge ACKs after each round of kill tickles */
+#define KILL_ROUND_MS	100
+/* Tickles sent between two looks at the packet socket */
+#define KILL_BATCH	64
+
+/* A kill run: the packet socket and the connections reset so far */
+struct kill_ctx {
+	struct tickle_sender *snd;
+	struct tuple_set *set;
+	struct tuple_set dead;
+	int s;
+};
+
+/*
+ * Passes TCP segments that have ACK set and neither SYN nor RST, as
+ * seen on a SOCK_DGRAM packet socket (offsets start at the IP header).
+ * IPv6 packets with extension headers are not looked at.
+ */
+static struct sock_filter kill_filter[] = {
+	BPF_STMT(BPF_LD|BPF_W|BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, PACKET_OUTGOING, 13, 0),
+	BPF_STMT(BPF_LD|BPF_H|BPF_ABS, SKF_AD_OFF + SKF_AD_PROTOCOL),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ETH_P_IP, 0, 5),
+	/* IPv4 */
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 9),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_TCP, 0, 9),
+	BPF_STMT(BPF_LDX|BPF_B|BPF_MSH, 0),
+	BPF_STMT(BPF_LD|BPF_B|BPF_IND, 13),
+	BPF_JUMP(BPF_JMP|BPF_JA, 4, 0, 0),
+	/* IPv6 */
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, ETH_P_IPV6, 0, 5),
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 6),
+	BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, IPPROTO_TCP, 0, 3),
+	BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 40 + 13),
+	/* TCP flags */
+	BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, TH_ACK, 0, 1),
+	BPF_JUMP(BPF_JMP|BPF_JSET|BPF_K, TH_SYN|TH_RST, 0, 1),
+	BPF_STMT(BPF_RET|BPF_K, 0),
+	BPF_STMT(BPF_RET|BPF_K, 0xFFFF),
+};
+
+static long now_ms(void)
+{
+	return mono_ns() / 1000000;
+}
+
+/*
+ * Pick the connection and the sequence numbers out of a segment the
+ * peer sent us on interface ifindex.  Returns the TCP header, or NULL
+ * if it is not one.
+ */
+static const struct tcphdr *parse_segment(const uint8_t *buf, size_t len,
+					  int ifindex,
+					  sock_addr *local, sock_addr *peer)
+{
+	const struct iphdr *ip = (const struct iphdr *)buf;
+	const struct ip6_hdr *ip6 = (const struct ip6_hdr *)buf;
+	const struct tcphdr *tcp;
+	size_t hlen;
+
+	memset(local, 0, sizeof(*local));
+	memset(peer, 0, sizeof(*peer));
+
+	if (len >= sizeof(*ip) && ip->version == 4) {
+		hlen = ip->ihl * 4;
+		if (ip->protocol != IPPROTO_TCP || len < hlen + sizeof(*tcp))
+			return NULL;
+		tcp = (const struct tcphdr *)(buf + hlen);
+		local->ip.sin_family      = AF_INET;
+		local->ip.sin_addr.s_addr = ip->daddr;
+		local->ip.sin_port        = tcp->dest;
+		peer->ip.sin_family       = AF_INET;
+		peer->ip.sin_addr.s_addr  = ip->saddr;
+		peer->ip.sin_port         = tcp->source;
+		return tcp;
+	}
+	if (len >= sizeof(*ip6) + sizeof(*tcp) && (ip6->ip6_vfc >> 4) == 6) {
+		if (ip6->ip6_nxt != IPPROTO_TCP)
+			return NULL;
+		tcp = (const struct tcphdr *)(buf + sizeof(*ip6));
+		local->ip6.sin6_family = AF_INET6;
+		local->ip6.sin6_addr   = ip6->ip6_dst;
+		local->ip6.sin6_port   = tcp->dest;
+		peer->ip6.sin6_family  = AF_INET6;
+		peer->ip6.sin6_addr    = ip6->ip6_src;
+		peer->ip6.sin6_port    = tcp->source;
+		/* link-local addresses mean nothing without the link */
+		if (IN6_IS_ADDR_LINKLOCAL(&ip6->ip6_src))
+			peer->ip6.sin6_scope_id = ifindex;
+		if (IN6_IS_ADDR_LINKLOCAL(&ip6->ip6_dst))
+			local->ip6.sin6_scope_id = ifindex;
+		return tcp;
+	}
+	return NULL;
+}
+
+/*
+ * Answer the challenge ACKs that are waiting on the packet socket,
+ * without blocking.
+ */
+static int kill_drain(struct kill_ctx *k)
+{
+	struct tickle_pkt pkt;
+	const struct tcphdr *tcp;
+	struct tuple_key key;
+	struct sockaddr_ll sll;
+	socklen_t slen;
+	sock_addr local, peer;
+	uint8_t buf[256];
+	ssize_t len;
+
+	for (;;) {
+		slen = sizeof(sll);
+		len = recvfrom(k->s, buf, sizeof(buf), 0,
+			       (struct sockaddr *)&sll, &slen);
+		if (len < 0)
+			return errno == EAGAIN || errno == EINTR ? 0 : -1;
+		tcp = parse_segment(buf, len, sll.sll_ifindex, &local, &peer);
+		if (!tcp)
+			continue;
+		tuple_to_key(&local, &peer, &key);
+		if (!k->set->slots[tuple_set_slot(k->set, &key)].family)
+			continue;
+
+		/*
+		 * Answer every challenge ACK, even for a connection we
+		 * reset already: our RST may have been lost.
+		 */
+		if (build_tickle_pkt(&pkt, &peer, &local, 0, 0, 1))
+			continue;
+		tickle_pkt_set_seq(&pkt, tcp->ack_seq, tcp->seq);
+		if (send_tickle_pkt(k->snd, &pkt, &peer) == 0 &&
+		    tuple_set_add(&k->dead, &key) < 0)
+			return -1;
+	}
+}
+
+/*
+ * sender_pace() for kill mode: the challenge ACKs that come in while
+ * we wait for the rate limit are answered right away, instead of
+ * piling up in the packet socket until it drops them.
+ */
+static int kill_pace(struct kill_ctx *k)
+{
+	struct pollfd pfd[2];
+	uint64_t wait, expirations;
+
+	while ((wait = sender_due(k->snd)) != 0) {
+		if (sender_arm(k->snd, mono_ns() + wait))
+			return -1;
+		pfd[0].fd = k->snd->tfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = k->s;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if ((pfd[1].revents & POLLIN) && kill_drain(k))
+			return -1;
+		if (pfd[0].revents & POLLIN &&
+		    read(k->snd->tfd, &expirations, sizeof(expirations)) < 0 &&
+		    errno != EINTR)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Actively reset the connections in set.  A tickle ACK with bogus
+ * sequence numbers makes the peer answer with a challenge ACK that
+ * carries the sequence number it expects from us; we capture that on
+ * a packet socket and answer with an RST that uses exactly that
+ * number.  The socket is read between batches of tickles and while
+ * pacing, so the answers do not overflow it on large sets.
+ * Connections that have not answered are tickled again, for up to
+ * rounds rounds.  Returns the number of connections left alive.
+ */
+int kill_connections(struct tickle_sender *snd, struct tuple_set *set,
+		     int rounds)
+{
+	struct kill_ctx k;
+	struct sock_fprog prog;
+	struct tickle_pkt pkt;
+	struct pollfd pfd;
+	sock_addr src, dst;
+	size_t i, sent;
+	long deadline, left;
+	int round, ret = -1;
+
+	k.snd = snd;
+	k.set = set;
+	if (tuple_set_init(&k.dead, set->count))
+		return -1;
+
+	k.s = socket(AF_PACKET, SOCK_DGRAM, htons(ETH_P_ALL));
+	if (k.s == -1) {
+		fprintf(stderr, "Failed to open packet socket (%s)\n", strerror(errno));
+		goto out;
+	}
+	set_close_on_exec(k.s);
+
+	prog.len = sizeof(kill_filter) / sizeof(kill_filter[0]);
+	prog.filter = kill_filter;
+	if (setsockopt(k.s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))) {
+		fprintf(stderr, "Failed to attach filter (%s)\n", strerror(errno));
+		goto out;
+	}
+	set_nonblocking(k.s);
+
+	for (round = 0; round < rounds && k.dead.count < set->count; round++) {
+		sent = 0;
+		for (i = 0; i < set->size; i++) {
+			if (!set->slots[i].family ||
+			    k.dead.slots[tuple_set_slot(&k.dead, &set->slots[i])].family)
+				continue;
+			rec_to_tuple(set->slots[i].family == 4 ? AF_INET : AF_INET6,
+				     &set->slots[i].rec, &src, &dst);
+			if (kill_pace(&k))
+				goto out;
+			if (build_tickle_pkt(&pkt, &dst, &src, 0, 0, 0) == 0)
+				send_tickle_pkt(snd, &pkt, &dst);
+			if (++sent % KILL_BATCH == 0 && kill_drain(&k))
+				goto out;
+		}
+
+		deadline = now_ms() + KILL_ROUND_MS;
+		while ((left = deadline - now_ms()) > 0 && k.dead.count < set->count) {
+			pfd.fd = k.s;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, left) <= 0)
+				continue;
+			if (kill_drain(&k))
+				goto out;
+		}
+	}
+	stats.killed = k.dead.count;
+	ret = set->count - k.dead.count;
+out:
+	if (k.s != -1)
+		close(k.s);
+	tuple_set_free(&k.dead);
+	return ret;
+}
+
+static int write_tuple(const sock_addr *src, const sock_addr *dst, void *priv)
+{
+	struct state_writer *w = priv;
+	char addr1[64], addr2[64];
+
+	if (format_ip_port(src, addr1, sizeof(addr1)) ||
+	    format_ip_port(dst, addr2, sizeof(addr2)))
+		return -1;
+
+	fprintf(w->f, "%s\t%s\n", addr1, addr2);
+	return 0;
+}
+
+/* A tickle packet built once and sent in every round */
+struct tickle_out {
+	struct tickle_pkt pkt;
+	sock_addr dst;
+};
+
+/*
+ * Every connection is tickled once per round, so duplicates collected
+ * from several state files cost nothing and the repetitions for one
+ * connection are spread over the whole run.  Round n starts no earlier
+ * than n * spacing_ms after the first one.  The packets are built
+ * before the first round; the rounds only pace and send them.
+ */
+int tickle_rounds(struct tickle_sender *snd, struct tuple_set *set,
+		  int rounds, unsigned spacing_ms)
+{
+	int round, failed = 0, ret = -1;
+	size_t i, n = 0;
+	uint64_t start;
+	struct tickle_out *out;
+	sock_addr src;
+
+	if (!set->count || rounds <= 0)
+		return 0;
+	out = malloc(set->count * sizeof(*out));
+	if (!out) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		return -1;
+	}
+	for (i = 0; i < set->size; i++) {
+		if (!set->slots[i].family)
+			continue;
+		rec_to_tuple(set->slots[i].family == 4 ? AF_INET : AF_INET6,
+			     &set->slots[i].rec, &src, &out[n].dst);
+		if (build_tickle_pkt(&out[n].pkt, &out[n].dst, &src, 0, 0, 0))
+			goto done;
+		n++;
+	}
+
+	start = mono_ns();
+	for (round = 0; round < rounds; round++) {
+		if (sender_sleep_until(snd, start +
+				       (uint64_t)round * spacing_ms * 1000000))
+			goto done;
+		for (i = 0; i < n; i++) {
+			if (sender_pace(snd))
+				goto done;
+			/* a failed connection must not stop the others */
+			if (send_tickle_pkt(snd, &out[i].pkt, &out[i].dst))
+				failed = 1;
+		}
+	}
+	ret = failed ? -1 : 0;
+done:
+	free(out);
+	return ret;
+}
+
+/* Only the first failure of each kind is reported as it happens */
+static void stats_send_error(int err)
+{
+	int i;
+
+	stats.send_errors++;
+	for (i = 0; i < STATS_MAX_ERRNO && stats.errnos[i].count; i++) {
+		if (stats.errnos[i].err == err) {
+			stats.errnos[i].count++;
+			return;
+		}
+	}
+	fprintf(stderr, "Failed sendto (%s)\n", strerror(err));
+	if (i < STATS_MAX_ERRNO) {
+		stats.errnos[i].err = err;
+		stats.errnos[i].count = 1;
+	}
+}
+
+static int collect_tuple(const sock_addr *src, const sock_addr *dst, void *priv)
+{
+	struct tuple_key key;
+	int ret;
+
+	tuple_to_key(src, dst, &key);
+	ret = tuple_set_add(priv, &key);
+	if (ret < 0)
+		return -1;
+	if (ret)
+		stats.tuples++;
+	else
+		stats.duplicates++;
+	return 0;
+}
+
+/* Write the run summary to path ("-" for stdout) */
+int print_stats(const char *path, int json)
+{
+	FILE *f = stdout;
+	double elapsed, send_time, pps = 0;
+	int i;
+
+	if (strcmp(path, "-") != 0) {
+		f = fopen(path, "w");
+		if (!f) {
+			fprintf(stderr, "Failed to open %s (%s)\n", path, strerror(errno));
+			return -1;
+		}
+	}
+
+	elapsed = (stats.end_ns - stats.start_ns) / 1e9;
+	if (stats.send_start_ns) {
+		send_time = (stats.end_ns - stats.send_start_ns) / 1e9;
+		if (send_time > 0)
+			pps = stats.sent / send_time;
+	}
+
+	if (json) {
+		fprintf(f, "{\"tuples\": %llu, \"duplicates\": %llu, "
+			"\"bad_lines\": %llu, \"bad_inputs\": %llu, "
+			"\"packets_sent\": %llu, \"send_errors\": %llu, "
+			"\"killed\": %llu, \"errors\": [",
+			(unsigned long long)stats.tuples,
+			(unsigned long long)stats.duplicates,
+			(unsigned long long)stats.bad_lines,
+			(unsigned long long)stats.bad_inputs,
+			(unsigned long long)stats.sent,
+			(unsigned long long)stats.send_errors,
+			(unsigned long long)stats.killed);
+		for (i = 0; i < STATS_MAX_ERRNO && stats.errnos[i].count; i++)
+			fprintf(f, "%s{\"errno\": %d, \"error\": \"%s\", \"count\": %llu}",
+				i ? ", " : "", stats.errnos[i].err,
+				strerror(stats.errnos[i].err),
+				(unsigned long long)stats.errnos[i].count);
+		fprintf(f, "], \"elapsed_ms\": %.3f, \"pps\": %.0f}\n",
+			elapsed * 1000, pps);
+	} else {
+		fprintf(f, "tuples: %llu (%llu duplicates, %llu bad lines, %llu unreadable inputs)\n",
+			(unsigned long long)stats.tuples,
+			(unsigned long long)stats.duplicates,
+			(unsigned long long)stats.bad_lines,
+			(unsigned long long)stats.bad_inputs);
+		fprintf(f, "packets: %llu sent, %llu failed\n",
+			(unsigned long long)stats.sent,
+			(unsigned long long)stats.send_errors);
+		for (i = 0; i < STATS_MAX_ERRNO && stats.errnos[i].count; i++)
+			fprintf(f, "  %s: %llu\n", strerror(stats.errnos[i].err),
+				(unsigned long long)stats.errnos[i].count);
+		if (stats.killed)
+			fprintf(f, "killed: %llu\n", (unsigned long long)stats.killed);
+		fprintf(f, "elapsed: %.3f s, %.0f packets/s\n", elapsed, pps);
+	}
+
+	if (f != stdout)
+		fclose(f);
+	else
+		fflush(f);
+	return 0;
+}
+
+static void usage(void)
+{
+	printf("Usage: /usr/lib/heartbeat/tickle_tcp [ -n num ] [ -p pps ] [ -s msecs ] [ -d local_ip ] [ -f file ... ]\n");
+	printf("       /usr/lib/heartbeat/tickle_tcp [ -d local_ip ] [ -f file ... ] -w file [ -b ]\n");
+	printf("       /usr/lib/heartbeat/tickle_tcp [ -n num ] [ -p pps ] [ -s msecs ] -t tickle_dir vip ...\n");
+	printf("       /usr/lib/heartbeat/tickle_tcp -k [ -n rounds ] [ -p pps ] [ -d local_ip ] [ -f file ... ]\n");
+	printf("       /usr/lib/heartbeat/tickle_tcp -r local_ip -w file [ -b ] [ -i interval ]\n");
+	printf("Please note that this program need to read the list of\n");
+	printf("{local_ip:port remote_ip:port} from stdin.\n");
+	printf("  -n num      : send num rounds of tickle acks\n");
+	printf("  -p pps      : send at most pps packets per second\n");
+	printf("  -s msecs    : start the rounds msecs apart\n");
+	printf("  -S file     : write a summary of the run to file (\"-\" for stdout)\n");
+	printf("  -j          : write the summary as JSON\n");
+	printf("  -d local_ip : take the established connections of local_ip\n");
+	printf("                from the kernel (sock_diag) instead of stdin\n");
+	printf("  -f file     : read the connections from a state file (text or\n");
+	printf("                binary), or from every state file in a directory,\n");
+	printf("                instead of stdin; may be repeated.  Connections\n");
+	printf("                found more than once are tickled once per round.\n");
+	printf("  -t dir      : read the state files of the VIPs given as arguments\n");
+	printf("                from the tickle directory dir\n");
+	printf("  -w file     : write the connections to a state file (\"-\" for\n");
+	printf("                stdout) instead of tickling them\n");
+	printf("  -b          : write the state file in the binary format\n");
+	printf("  -k          : kill the connections: answer the peer's challenge\n");
+	printf("                ACK with an RST, tickling for up to -n rounds\n");
+	printf("  -r local_ip : keep recording the connections of local_ip to the\n");
+	printf("                state file; only changes are appended to a journal\n");
+	printf("  -i interval : seconds between two polls of the recorder (1)\n");
+	exit(1);
+}
+
+#define OPTION_STRING "n:p:s:S:jd:f:t:w:br:i:kh"
+
+int main(int argc, char *argv[])
+{
+	int optchar, num = 1, cont = 1, ret = 0, binary = 0, interval = 1;
+	int kill = 0, alive;
+	unsigned pps = 0, spacing = 0;
+	struct tickle_sender snd;
+	sock_addr local;
+	const char *diag_ip = NULL, *outfile = NULL;
+	const char *record_ip = NULL, *statsfile = NULL, *tickle_dir = NULL;
+	const char **infiles;
+	int json = 0;
+	int i, ninfiles = 0;
+	struct tuple_set set;
+	struct stat st;
+
+	stats.start_ns = mono_ns();
+
+	infiles = calloc(argc, sizeof(*infiles));
+	if (!infiles) {
+		fprintf(stderr, "Failed to allocate memory\n");
+		return -1;
+	}
+
+	while(cont) {
+		optchar = getopt(argc, argv, OPTION_STRING);
+		switch(optchar) {
+		case 'n':
+			num = atoi(optarg);
+			break;
+		case 'p':
+			pps = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			spacing = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			statsfile = optarg;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'd':
+			diag_ip = optarg;
+			break;
+		case 'f':
+			infiles[ninfiles++] = optarg;
+			break;
+		case 't':
+			tickle_dir = optarg;
+			break;
+		case 'w':
+			outfile = optarg;
+			break;
+		case 'b':
+			binary = 1;
+			break;
+		case 'r':
+			record_ip = optarg;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'k':
+			kill = 1;
+			break;
+		case 'h':
+			usage();
+			exit(EXIT_SUCCESS);
+			break;
+		case EOF:
+			cont = 0;
+			break;
+		default:
+			fprintf(stderr, "unknown option, please use '-h' for usage.\n");
+			exit(EXIT_FAILURE);
+			break;
+		};
+	}
+
+	if (record_ip) {
+		if (!outfile || strcmp(outfile, "-") == 0 || interval < 1) {
+			fprintf(stderr, "-r needs a state file (-w) and an interval >= 1\n");
+			exit(EXIT_FAILURE);
+		}
+		if (parse_ip(record_ip, NULL, 0, &local)) {
+			fprintf(stderr, "Bad IP '%s'\n", record_ip);
+			return -1;
+		}
+		return record_connections(&local, outfile, interval, binary);
+	}
+
+	if (!tickle_dir != (optind == argc)) {
+		fprintf(stderr, "-t needs a list of VIPs and VIPs need -t\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (kill && outfile) {
+		fprintf(stderr, "-k and -w cannot be used together\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* collect (and deduplicate) all connections first */
+	if (tuple_set_init(&set, 0))
+		return -1;
+
+	/*
+	 * An input that cannot be read is reported in the exit status, but
+	 * the connections from all the others are still tickled.
+	 */
+	if (diag_ip) {
+		if (parse_ip(diag_ip, NULL, 0, &local)) {
+			fprintf(stderr, "Bad IP '%s'\n", diag_ip);
+			return -1;
+		}
+		if (diag_dump(&local, collect_tuple, &set)) {
+			stats.bad_inputs++;
+			ret = -1;
+		}
+	}
+	for (i = 0; i < ninfiles; i++) {
+		/* a directory counts its bad state files itself */
+		if (stat(infiles[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+			if (read_state_dir(infiles[i], collect_tuple, &set))
+				ret = -1;
+		} else if (read_state(infiles[i], collect_tuple, &set)) {
+			stats.bad_inputs++;
+			ret = -1;
+		}
+	}
+	/* the VIPs of a group failover all go through the one sender */
+	if (tickle_dir &&
+	    read_vip_states(tickle_dir, argv + optind, argc - optind,
+			    collect_tuple, &set))
+		ret = -1;
+	if (!diag_ip && !ninfiles && !tickle_dir &&
+	    read_text_stream(STDIN_FILENO, collect_tuple, &set)) {
+		stats.bad_inputs++;
+		ret = -1;
+	}
+	if (stats.bad_lines)
+		ret = -1;
+
+	if (outfile) {
+		/* a partial state file must not replace the previous one */
+		if (!ret)
+			ret = write_state(outfile, &set, binary, 0);
+	} else if (sender_init(&snd, pps)) {
+		ret = -1;
+	} else {
+		stats.send_start_ns = mono_ns();
+		if (kill) {
+			alive = kill_connections(&snd, &set, num);
+			if (alive > 0)
+				fprintf(stderr, "%d connection(s) could not be killed\n", alive);
+			if (alive)
+				ret = -1;
+		} else if (tickle_rounds(&snd, &set, num, spacing)) {
+			ret = -1;
+		}
+		sender_close(&snd);
+	}
+
+	stats.end_ns = mono_ns();
+	if (statsfile)
+		print_stats(statsfile, json);
+
+	tuple_set_free(&set);
+	free(infiles);
+	return ret;
 }